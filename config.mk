@@ -80,6 +80,18 @@ CONFIG_DEBUG = user kernel
 #
 CONFIG_NDEBUG =
 
+###########################################################################
+# MALLOC_STATS
+###########################################################################
+# Set CONFIG_MALLOC_STATS to "user" to #define the MALLOC_STATS flag when
+# compiling user code. The thread library's malloc wrappers then keep the
+# allocation statistics reported by malloc_stats_get()/malloc_stats_dump(),
+# at the cost of a few atomic instructions per call.
+#
+# Use "make veryclean" if you adjust CONFIG_MALLOC_STATS.
+#
+CONFIG_MALLOC_STATS =
+
 ###########################################################################
 # The method for acquiring project updates.
 ###########################################################################
@@ -111,7 +123,7 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS =
+STUDENTTESTS = cond_broadcast_bench barrier_bench
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -132,7 +144,7 @@ STUDENTFILES =
 ###########################################################################
 # Object files for your thread library
 ###########################################################################
-THREAD_OBJS = malloc.o panic.o mutex.o atomic_increment.o cond_var.o thread.o thread_helpers.o create_new_thread.o read_ebp.o semaphore.o swexn_handler.o rwlock.o rwlock_helper.o
+THREAD_OBJS = malloc.o panic.o mutex.o cond_var.o thread.o thread_helpers.o create_new_thread.o read_ebp.o semaphore.o swexn_handler.o rwlock.o rwlock_helper.o thrpool.o fiber.o fiber_switch.o future.o timeout.o barrier.o chan.o thr_key.o vanish_off_stack.o
 
 # Thread Group Library Support.
 #
@@ -0,0 +1,147 @@
+/** @file atomic.h
+ *  @brief atomic operations and fences for i386
+ *
+ *  Every operation is inlined into its caller. The read-modify-write
+ *  operations are locked instructions, so they are also full memory
+ *  barriers; plain loads and stores of aligned words are atomic on their
+ *  own, and x86 only lets a later load pass an earlier store, which is
+ *  what memory_barrier() is for.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+/** @brief keeps the compiler from moving memory accesses across it */
+#define compiler_barrier() __asm__ __volatile__("" : : : "memory")
+
+/** @brief tells the processor it is in a spin loop (pause)
+ *  @return void
+ */
+static inline void cpu_relax(void)
+{
+  __asm__ __volatile__("pause" : : : "memory");
+}
+
+/** @brief full memory barrier, no load or store passes it
+ *
+ *  a locked add to the top of the stack, which every i386 has, unlike
+ *  mfence
+ *
+ *  @return void
+ */
+static inline void memory_barrier(void)
+{
+  __asm__ __volatile__("lock; addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+/** @brief reads a word, later accesses are not moved before it
+ *  @param word pointer to the word
+ *  @return value of the word
+ */
+static inline unsigned int atomic_load(volatile unsigned int *word)
+{
+  unsigned int val = *word;
+  compiler_barrier();
+  return val;
+}
+
+/** @brief writes a word, earlier accesses are not moved after it
+ *  @param word pointer to the word
+ *  @param val the value to store
+ *  @return void
+ */
+static inline void atomic_store(volatile unsigned int *word, unsigned int val)
+{
+  compiler_barrier();
+  *word = val;
+}
+
+/** @brief compares and swaps a word atomically (lock cmpxchg)
+ *  @param word pointer to the word to update
+ *  @param expected the value the word must hold for the swap to happen
+ *  @param new_val the value to store into the word
+ *  @return previous value of the word, the swap happened iff it equals expected
+ */
+static inline unsigned int atomic_compare_swap(volatile unsigned int *word,
+                                               unsigned int expected,
+                                               unsigned int new_val)
+{
+  unsigned int old;
+  __asm__ __volatile__("lock; cmpxchgl %2, %1"
+                       : "=a" (old), "+m" (*word)
+                       : "r" (new_val), "0" (expected)
+                       : "memory", "cc");
+  return old;
+}
+
+/** @brief compares and swaps a double word atomically (lock cmpxchg8b)
+ *  @param dword pointer to the 8-byte aligned double word to update
+ *  @param expected the value the double word must hold for the swap
+ *  @param new_val the value to store into the double word
+ *  @return previous value of the double word, the swap happened iff it
+ *          equals expected
+ */
+static inline unsigned long long
+atomic_compare_swap64(volatile unsigned long long *dword,
+                      unsigned long long expected, unsigned long long new_val)
+{
+  unsigned long long old;
+  __asm__ __volatile__("lock; cmpxchg8b %1"
+                       : "=A" (old), "+m" (*dword)
+                       : "b" ((unsigned int)new_val),
+                         "c" ((unsigned int)(new_val >> 32)),
+                         "0" (expected)
+                       : "memory", "cc");
+  return old;
+}
+
+/** @brief swaps a value into a word atomically (xchg, locked implicitly)
+ *  @param word pointer to the word to update
+ *  @param val the value to store into the word
+ *  @return previous value of the word
+ */
+static inline unsigned int atomic_exchange(volatile unsigned int *word,
+                                           unsigned int val)
+{
+  __asm__ __volatile__("xchgl %0, %1"
+                       : "+r" (val), "+m" (*word)
+                       :
+                       : "memory");
+  return val;
+}
+
+/** @brief adds to a word atomically (lock xadd)
+ *  @param word pointer to the word to add to
+ *  @param delta the value to add, may be negative
+ *  @return previous value of the word
+ */
+static inline int atomic_fetch_add(volatile int *word, int delta)
+{
+  __asm__ __volatile__("lock; xaddl %0, %1"
+                       : "+r" (delta), "+m" (*word)
+                       :
+                       : "memory", "cc");
+  return delta;
+}
+
+/** @brief increments a word atomically
+ *  @param word pointer to the word to increment
+ *  @return previous value of the word
+ */
+static inline unsigned int atomic_increment(volatile unsigned int *word)
+{
+  return (unsigned int)atomic_fetch_add((volatile int *)word, 1);
+}
+
+/** @brief decrements a word atomically
+ *  @param word pointer to the word to decrement
+ *  @return previous value of the word
+ */
+static inline unsigned int atomic_decrement(volatile unsigned int *word)
+{
+  return (unsigned int)atomic_fetch_add((volatile int *)word, -1);
+}
+
+#endif /* _ATOMIC_H */
@@ -0,0 +1,19 @@
+/** @file autostack.h
+ *  @brief tuning and statistics of the root thread's automatic stack growth
+ *
+ *  The autostack handler grows the root stack of a program that has not
+ *  called thr_init. Each growth step maps twice as much as the one before,
+ *  up to a cap, and maps that much beyond the faulting address.
+ */
+
+#ifndef _AUTOSTACK_H
+#define _AUTOSTACK_H
+
+/** default cap of one growth step of the root stack, in bytes */
+#define AUTOSTACK_DEFAULT_MAX_GROW (1024 * 1024)
+
+void autostack_set_max_grow( unsigned int max_grow );
+unsigned int autostack_peak_depth( void );
+unsigned int autostack_fault_count( void );
+
+#endif /* _AUTOSTACK_H */
@@ -0,0 +1,17 @@
+/** @file barrier.h
+ *  @brief This file declares the barrier interface.
+ */
+
+#ifndef _BARRIER_H
+#define _BARRIER_H
+
+#include <barrier_type.h>
+
+/** returned by barrier_wait to the one thread that opened the barrier */
+#define BARRIER_SERIAL_THREAD 1
+
+int barrier_init( barrier_t *barrier, unsigned int count );
+void barrier_destroy( barrier_t *barrier );
+int barrier_wait( barrier_t *barrier );
+
+#endif /* _BARRIER_H */
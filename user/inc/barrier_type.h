@@ -0,0 +1,27 @@
+/** @file barrier_type.h
+ *  @brief This file defines the type for barriers.
+ */
+
+#ifndef _BARRIER_TYPE_H
+#define _BARRIER_TYPE_H
+
+#include <variable_queue.h>
+#include <mutex_type.h>
+
+struct thr_stack_meta;
+
+/// a queue type for threads blocked on a barrier
+Q_NEW_HEAD(barrier_queue_t, thr_stack_meta);
+
+/** struct encapsulating the type for the barrier synchronization primitive
+ */
+typedef struct barrier {
+  unsigned char valid;  ///< char indicating init status of barrier
+  unsigned int count;   ///< number of threads that meet at the barrier
+  volatile unsigned int remaining;  ///< threads yet to arrive this round
+  volatile unsigned int sense;  ///< flips every time the barrier opens
+  mutex_t mutex;  ///< protects the waiters queue
+  barrier_queue_t waiters;  ///< threads that gave up spinning and blocked
+} barrier_t;
+
+#endif /* _BARRIER_TYPE_H */
@@ -0,0 +1,17 @@
+/** @file chan.h
+ *  @brief This file declares the channel interface.
+ */
+
+#ifndef _CHAN_H
+#define _CHAN_H
+
+#include <chan_type.h>
+
+int chan_init( chan_t *chan, unsigned int capacity );
+void chan_destroy( chan_t *chan );
+int chan_try_send( chan_t *chan, void *msg );
+int chan_try_recv( chan_t *chan, void **msg );
+void chan_send( chan_t *chan, void *msg );
+void *chan_recv( chan_t *chan );
+
+#endif /* _CHAN_H */
@@ -0,0 +1,43 @@
+/** @file chan_type.h
+ *  @brief This file defines the type for channels.
+ */
+
+#ifndef _CHAN_TYPE_H
+#define _CHAN_TYPE_H
+
+#include <mutex_type.h>
+#include <cond_type.h>
+
+/** size of a cache line, keeps the send and receive positions apart */
+#define CHAN_CACHE_LINE 64
+
+/** one slot of the channel ring
+ */
+typedef struct chan_cell {
+  /// equals the send position that may fill the cell next, or that
+  /// position + 1 once the cell holds a message for receivers
+  volatile unsigned int seq;
+  void *msg;  ///< the message in the cell
+} chan_cell_t;
+
+/** a bounded multi-producer multi-consumer message channel
+ */
+typedef struct chan {
+  unsigned char valid;  ///< char indicating init status of channel
+  chan_cell_t *cells;   ///< ring of capacity cells
+  unsigned int mask;    ///< capacity - 1, capacity is a power of two
+
+  char pad0[CHAN_CACHE_LINE];
+  volatile unsigned int send_pos;  ///< position of the next send
+  char pad1[CHAN_CACHE_LINE];
+  volatile unsigned int recv_pos;  ///< position of the next receive
+  char pad2[CHAN_CACHE_LINE];
+
+  volatile unsigned int send_waiters; ///< senders blocked on a full channel
+  volatile unsigned int recv_waiters; ///< receivers blocked on an empty one
+  mutex_t mutex;    ///< taken only to block or to wake blocked threads
+  cond_t not_full;  ///< blocked senders wait here
+  cond_t not_empty; ///< blocked receivers wait here
+} chan_t;
+
+#endif /* _CHAN_TYPE_H */
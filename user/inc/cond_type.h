@@ -9,10 +9,10 @@
 #include <variable_queue.h>
 #include <mutex_type.h>
 
-/**  a queue type for keeping track of threads waiting on condition variable
- *
- */
-typedef struct cond_queue_t cond_queue_t; // forward declaration
+struct thr_stack_meta;
+
+/// a queue type for keeping track of threads waiting on condition variable
+Q_NEW_HEAD(cond_queue_t, thr_stack_meta);
 
 /** struct that encapsulates the type for the condition variable
  *  synchronization primitive
@@ -24,8 +24,9 @@ typedef struct cond
    * to grab its lock again*/
   unsigned char valid; ///< char telling whether conditional variable is valid
 
-  /// NULL-terminated doubly-linked-list
-  cond_queue_t* cond_queue;
+  /// NULL-terminated doubly-linked-list, stored inline so that neither
+  /// cond_init nor cond_wait touch the heap
+  cond_queue_t cond_queue;
 
   /// mutex to lock the thread queue
   mutex_t cond_mutex;
@@ -0,0 +1,18 @@
+/** @file fiber.h
+ *  @brief This file declares the user-level fiber interface.
+ */
+
+#ifndef _FIBER_H
+#define _FIBER_H
+
+#include <fiber_type.h>
+
+int fiber_init( int num_carriers );
+void fiber_shutdown( void );
+fiber_t *fiber_create( void (*func)(void *), void *arg );
+void fiber_yield( void );
+void fiber_exit( void );
+int fiber_join( fiber_t *fiber );
+int fiber_detach( fiber_t *fiber );
+
+#endif /* _FIBER_H */
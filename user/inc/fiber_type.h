@@ -0,0 +1,39 @@
+/** @file fiber_type.h
+ *  @brief This file defines the type for user-level fibers.
+ */
+
+#ifndef _FIBER_TYPE_H
+#define _FIBER_TYPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <variable_queue.h>
+
+/** size of every fiber stack, a power of two, the fiber's own struct sits
+ *  at the top of it so a fiber can find itself from its stack pointer */
+#define FIBER_STACK_SIZE 8192
+
+/* fiber states */
+#define FIBER_READY   0 ///< fiber is waiting on the run queue
+#define FIBER_RUNNING 1 ///< fiber is running on a carrier thread
+#define FIBER_BLOCKED 2 ///< fiber is waiting for another fiber to finish
+#define FIBER_EXITING 3 ///< fiber is switching out for the last time
+#define FIBER_DONE    4 ///< fiber has finished and is off its stack
+
+/** a user-level thread, multiplexed onto the carrier threads
+ */
+typedef struct fiber {
+  Q_NEW_LINK(fiber) run_link; ///< vq link for the run queue
+  void (*func)(void *); ///< function the fiber runs
+  void *arg;            ///< argument passed to func
+  uint32_t esp;         ///< saved stack pointer while switched out
+  int state;            ///< one of the FIBER_* states
+  bool detached;        ///< fiber frees itself when done
+  bool joined;          ///< someone has claimed the fiber for fiber_join
+  struct fiber *joiner; ///< fiber blocked in fiber_join on this fiber
+  struct fiber *join_target; ///< fiber this fiber is blocked on
+  struct fiber_carrier *carrier; ///< carrier thread running the fiber
+  uint32_t magic;       ///< marks the top of a fiber stack
+} fiber_t;
+
+#endif /* _FIBER_TYPE_H */
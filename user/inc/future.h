@@ -0,0 +1,21 @@
+/** @file future.h
+ *  @brief This file declares the futures and promises interface.
+ */
+
+#ifndef _FUTURE_H
+#define _FUTURE_H
+
+#include <future_type.h>
+#include <thrpool_type.h>
+
+future_t *future_create( void );
+void future_free( future_t *future );
+int future_set( future_t *future, void *value );
+void *future_get( future_t *future );
+bool future_is_ready( future_t *future );
+future_t *future_async( thrpool_t *pool, void *(*func)(void *), void *arg );
+future_t *future_then( future_t *future, thrpool_t *pool,
+                       void *(*func)(void *value, void *arg), void *arg );
+future_t *future_when_all( future_t **futures, int count );
+
+#endif /* _FUTURE_H */
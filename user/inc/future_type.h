@@ -0,0 +1,40 @@
+/** @file future_type.h
+ *  @brief This file defines the type for futures.
+ */
+
+#ifndef _FUTURE_TYPE_H
+#define _FUTURE_TYPE_H
+
+#include <stdbool.h>
+#include <variable_queue.h>
+#include <mutex_type.h>
+#include <cond_type.h>
+
+struct thrpool;
+
+/** a continuation waiting for a future to complete
+ */
+typedef struct future_cont {
+  Q_NEW_LINK(future_cont) cont_link; ///< vq link for the future's continuations
+  void *(*func)(void *value, void *arg); ///< runs with the completed value
+  void *arg;              ///< second argument passed to func
+  void *value;            ///< the completed value, once there is one
+  struct future *result;  ///< future completed with func's return, or NULL
+  struct thrpool *pool;   ///< pool to run func on, NULL runs it inline
+} future_cont_t;
+
+/// declares the continuation list type
+Q_NEW_HEAD(future_cont_list_t, future_cont);
+
+/** the result of an asynchronous computation, completed exactly once
+ */
+typedef struct future {
+  bool ready;   ///< whether the value has been set
+  void *value;  ///< the value, valid once ready
+  int remaining;  ///< futures future_when_all still waits for
+  mutex_t mutex;  ///< protects the fields of the future
+  cond_t cv;      ///< wakes threads blocked in future_get
+  future_cont_list_t conts; ///< continuations to run on completion
+} future_t;
+
+#endif /* _FUTURE_TYPE_H */
@@ -0,0 +1,17 @@
+/** @file malloc_stats.h
+ *  @brief allocation statistics of the thread-safe malloc wrappers
+ *
+ *  The statistics are only kept when the thread library is built with
+ *  MALLOC_STATS defined, see CONFIG_MALLOC_STATS in config.mk; otherwise
+ *  these functions report that nothing was recorded.
+ */
+
+#ifndef _MALLOC_STATS_H
+#define _MALLOC_STATS_H
+
+#include <malloc_stats_type.h>
+
+int malloc_stats_get( malloc_stats_t *stats );
+void malloc_stats_dump( void );
+
+#endif /* _MALLOC_STATS_H */
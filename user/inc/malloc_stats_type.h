@@ -0,0 +1,42 @@
+/** @file malloc_stats_type.h
+ *  @brief This file defines the type for allocation statistics.
+ */
+
+#ifndef _MALLOC_STATS_TYPE_H
+#define _MALLOC_STATS_TYPE_H
+
+#include <stddef.h>
+
+/** number of small size classes, class c holds blocks of 16 << c bytes */
+#define MALLOC_NUM_CLASSES 8
+/** log2 of the smallest size class */
+#define MALLOC_MIN_CLASS_SHIFT 4
+/** number of call sites tracked, later sites are counted as untracked */
+#define MALLOC_STATS_SITES 64
+
+/** allocation totals of one call site
+ */
+typedef struct malloc_site_stats {
+  unsigned int site;    ///< return address into the calling function
+  unsigned int allocs;  ///< allocations made from the site
+  unsigned int bytes;   ///< bytes requested from the site
+} malloc_site_stats_t;
+
+/** a snapshot of the allocation statistics, see malloc_stats_get
+ */
+typedef struct malloc_stats {
+  unsigned int live_bytes;  ///< bytes requested and not yet freed
+  unsigned int peak_bytes;  ///< highest live_bytes ever seen
+  unsigned int allocs;      ///< blocks handed out
+  unsigned int frees;       ///< blocks given back
+  unsigned int refills;     ///< trips to the heap to fill a thread cache
+  unsigned int flushes;     ///< trips to the heap to trim a thread cache
+  /// blocks handed out by size class, the last entry counts large blocks
+  unsigned int class_allocs[MALLOC_NUM_CLASSES + 1];
+  /// blocks given back by size class, the last entry counts large blocks
+  unsigned int class_frees[MALLOC_NUM_CLASSES + 1];
+  unsigned int untracked_allocs;  ///< allocations from sites past the table
+  malloc_site_stats_t sites[MALLOC_STATS_SITES];  ///< unused ones have site 0
+} malloc_stats_t;
+
+#endif /* _MALLOC_STATS_TYPE_H */
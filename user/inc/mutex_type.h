@@ -6,6 +6,13 @@
 #define _MUTEX_TYPE_H
 
 #include <stdbool.h>
+#include <variable_queue.h>
+
+struct thr_stack_meta;
+struct mutex_skip;
+
+/// a queue type for threads moved off a condition variable onto a mutex
+Q_NEW_HEAD(mutex_queue_t, thr_stack_meta);
 
 /** struct encapsulating the type for the mutex synchronization primitive
  */
@@ -13,6 +20,13 @@ typedef struct mutex {
   unsigned char valid; ///< char indicating init status of mutex
   unsigned int ticket_num; ///< record of current ticket_num of the mutex
   unsigned int turn;       ///< record of current turn
+  unsigned int morph_lock; ///< spin lock protecting morph_queue
+  /// cond_broadcast waiters parked here, one is woken per unlock
+  mutex_queue_t morph_queue;
+  /// mutex_timedlock waiters sleeping until their ticket is served
+  mutex_queue_t ticket_queue;
+  /// tickets given up by timed out waiters, in ticket order
+  struct mutex_skip *skipped;
 } mutex_t;
 
 #endif /* _MUTEX_TYPE_H */
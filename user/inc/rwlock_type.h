@@ -11,6 +11,12 @@
 #include <thr_internals.h>
 #include <mutex.h>
 
+/*  fairness policies for rwlock_init_ex  */
+#define RWLOCK_POLICY_FIFO 0    ///< lock is granted in arrival order
+#define RWLOCK_POLICY_READER 1  ///< readers enter whenever no writer holds it
+#define RWLOCK_POLICY_WRITER 2  ///< waiting writers go before any reader
+#define RWLOCK_POLICY_PHASE_FAIR 3  ///< read and write phases alternate
+
 /** redefines queue header struct created with the
  *  variable queue library
  */
@@ -21,15 +27,20 @@ typedef struct rw_queue_t rw_queue_t;
 typedef struct rwlock {
   bool valid; ///< boolean indicating whether lock is initialized or not
 
-  /// mutex to protect access to the internal mutexes and count
+  /// writer bit, waiting bit and reader count, see RW_STATE_WRITER.
+  /// Uncontended lock and unlock only update this word atomically.
+  volatile unsigned int state;
+
+  /// mutex to protect the waiting queue, taken only under contention
   mutex_t data_mutex;
 
   /// waiting queue for threads that want to aquire the lock
   rw_queue_t* waiting_rw;
 
-  // internal structure of rw_lock
-  int reader_count; ///< number of readers currently holding the lock
-  int mode; ///< lock mode, either reading, writing, or unlocked
+  int policy; ///< fairness policy, see RWLOCK_POLICY_FIFO
+  int writers_waiting;  ///< queued writers plus a pending upgrade
+  /// reader waiting in rwlock_upgrade for the other readers to leave
+  thr_stack_meta_t* upgrader;
 } rwlock_t;
 
 #endif /* _RWLOCK_TYPE_H */
@@ -13,7 +13,10 @@
  */
 typedef struct sem {
   unsigned char valid; ///< char indicating initialization off semaphore
-  int count;  ///< current magnitude of semaphore
+  /// available units when positive, minus the number of blocked waiters
+  /// when negative; only changed atomically
+  int count;
+  int wakeups;  ///< units handed to blocked waiters, protected by lock
   mutex_t lock; ///< internal mutex for making internal accesses atomic
   cond_t cv;  ///< internal condition variable for semaphore functionality
 } sem_t;
@@ -0,0 +1,21 @@
+/** @file sync_ext.h
+ *  @brief This file declares the extensions to the synchronization
+ *         primitives: non-blocking and deadline-bounded waits.
+ *
+ *  Deadlines are absolute get_ticks() values.
+ */
+
+#ifndef _SYNC_EXT_H
+#define _SYNC_EXT_H
+
+#include <mutex_type.h>
+#include <cond_type.h>
+#include <rwlock_type.h>
+
+int mutex_trylock( mutex_t *mp );
+int mutex_timedlock( mutex_t *mp, unsigned int deadline );
+int cond_timedwait( cond_t *cv, mutex_t *mp, unsigned int deadline );
+int rwlock_init_ex( rwlock_t *rwlock, int policy );
+int rwlock_upgrade( rwlock_t *rwlock );
+
+#endif /* _SYNC_EXT_H */
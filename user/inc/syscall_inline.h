@@ -0,0 +1,101 @@
+/** @file syscall_inline.h
+ *  @brief inline versions of the system calls on the thread library's
+ *         hot paths
+ *
+ *  Each one traps straight from its caller instead of calling the stub in
+ *  libsyscall, which builds a stack frame and saves %esi around the INT.
+ *  The single argument goes in %esi and the result comes back in %eax;
+ *  the kernel preserves every other register. The "memory" clobber keeps
+ *  the compiler from caching memory across the trap, since the kernel may
+ *  read or write it (the deschedule reject word) and another thread may
+ *  run in between.
+ *
+ *  The out-of-line stubs in libsyscall stay the public interface, these
+ *  are for code where the call overhead matters.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#ifndef _SYSCALL_INLINE_H
+#define _SYSCALL_INLINE_H
+
+#include <syscall_int.h>
+
+/** @brief inline gettid
+ *  @return the tid of the calling thread
+ */
+static inline int inline_gettid(void)
+{
+  int ret;
+  __asm__ __volatile__("int %1" : "=a" (ret) : "i" (GETTID_INT) : "memory");
+  return ret;
+}
+
+/** @brief inline yield
+ *  @param tid the thread to yield to, -1 for any thread
+ *  @return 0 on success, negative number if tid can't be run
+ */
+static inline int inline_yield(int tid)
+{
+  int ret;
+  __asm__ __volatile__("int %1"
+                       : "=a" (ret)
+                       : "i" (YIELD_INT), "S" (tid)
+                       : "memory");
+  return ret;
+}
+
+/** @brief inline deschedule
+ *  @param reject the calling thread is not descheduled if *reject is
+ *         nonzero
+ *  @return 0 on success, negative number on failure
+ */
+static inline int inline_deschedule(int *reject)
+{
+  int ret;
+  __asm__ __volatile__("int %1"
+                       : "=a" (ret)
+                       : "i" (DESCHEDULE_INT), "S" (reject)
+                       : "memory");
+  return ret;
+}
+
+/** @brief inline make_runnable
+ *  @param tid the descheduled thread to wake
+ *  @return 0 on success, negative number if tid is not descheduled
+ */
+static inline int inline_make_runnable(int tid)
+{
+  int ret;
+  __asm__ __volatile__("int %1"
+                       : "=a" (ret)
+                       : "i" (MAKE_RUNNABLE_INT), "S" (tid)
+                       : "memory");
+  return ret;
+}
+
+/** @brief inline get_ticks
+ *  @return the number of timer ticks since boot
+ */
+static inline unsigned int inline_get_ticks(void)
+{
+  unsigned int ret;
+  __asm__ __volatile__("int %1" : "=a" (ret) : "i" (GET_TICKS_INT) : "memory");
+  return ret;
+}
+
+/** @brief inline sleep
+ *  @param ticks the number of timer ticks to sleep for
+ *  @return 0 on success, negative number if ticks is negative
+ */
+static inline int inline_sleep(int ticks)
+{
+  int ret;
+  __asm__ __volatile__("int %1"
+                       : "=a" (ret)
+                       : "i" (SLEEP_INT), "S" (ticks)
+                       : "memory");
+  return ret;
+}
+
+#endif /* _SYSCALL_INLINE_H */
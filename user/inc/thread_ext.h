@@ -0,0 +1,24 @@
+/** @file thread_ext.h
+ *  @brief This file declares the thread library functions that
+ *         extend the interface in thread.h.
+ */
+
+#ifndef _THREAD_EXT_H
+#define _THREAD_EXT_H
+
+/** thr_create_ex flag: the thread is never joined, its stack is recycled
+ *  once it exits */
+#define THR_CREATE_DETACHED 1
+
+/** a thread-local storage key, see thr_key_create */
+typedef unsigned int thr_key_t;
+
+int thr_create_ex( void *(*func)(void *), void *arg, unsigned int stack_size,
+                   unsigned int flags );
+int thr_detach( int tid );
+int thr_key_create( thr_key_t *key, void (*destructor)(void *) );
+int thr_key_delete( thr_key_t key );
+int thr_setspecific( thr_key_t key, void *value );
+void *thr_getspecific( thr_key_t key );
+
+#endif /* _THREAD_EXT_H */
@@ -0,0 +1,17 @@
+/** @file thrpool.h
+ *  @brief This file declares the work-stealing thread pool interface.
+ */
+
+#ifndef _THRPOOL_H
+#define _THRPOOL_H
+
+#include <thrpool_type.h>
+
+int thrpool_init( thrpool_t *pool, int num_workers );
+void thrpool_destroy( thrpool_t *pool );
+void thrpool_group_init( thrpool_group_t *group );
+int thrpool_submit( thrpool_t *pool, thrpool_group_t *group,
+                    void (*func)(void *), void *arg );
+void thrpool_wait( thrpool_t *pool, thrpool_group_t *group );
+
+#endif /* _THRPOOL_H */
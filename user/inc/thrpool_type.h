@@ -0,0 +1,68 @@
+/** @file thrpool_type.h
+ *  @brief This file defines the types for work-stealing thread pools.
+ */
+
+#ifndef _THRPOOL_TYPE_H
+#define _THRPOOL_TYPE_H
+
+#include <stdbool.h>
+#include <variable_queue.h>
+#include <mutex_type.h>
+#include <cond_type.h>
+
+/** number of task slots in each worker's deque, must be a power of two */
+#define THRPOOL_DEQUE_SIZE 256
+
+/** a unit of work submitted to a thread pool
+ */
+typedef struct thrpool_task {
+  Q_NEW_LINK(thrpool_task) task_link; ///< vq link for the pool's shared queue
+  void (*func)(void *); ///< function that runs the task
+  void *arg;            ///< argument passed to func
+  struct thrpool_group *group; ///< group the task counts against, or NULL
+} thrpool_task_t;
+
+/// declares the shared task queue type
+Q_NEW_HEAD(thrpool_task_queue_t, thrpool_task);
+
+/** Chase-Lev work-stealing deque, the owning worker pushes and takes at
+ *  the bottom, other workers steal from the top
+ */
+typedef struct thrpool_deque {
+  volatile int top;     ///< index of the oldest task, moved by thieves
+  volatile int bottom;  ///< index past the newest task, moved by the owner
+  thrpool_task_t *volatile tasks[THRPOOL_DEQUE_SIZE]; ///< circular task buffer
+} thrpool_deque_t;
+
+/** a persistent worker thread of a pool
+ */
+typedef struct thrpool_worker {
+  struct thrpool *pool; ///< pool the worker belongs to
+  int tid;              ///< thread id of the worker
+  int index;            ///< index of the worker in the pool
+  bool parked;          ///< whether the worker sits on the parked list
+  volatile int wake;    ///< deschedule reject flag for waking a parked worker
+  thrpool_deque_t deque; ///< tasks owned by the worker
+} thrpool_worker_t;
+
+/** a set of tasks that can be waited on together
+ */
+typedef struct thrpool_group {
+  volatile unsigned int pending; ///< tasks submitted but not yet finished
+} thrpool_group_t;
+
+/** encapsulates a pool of worker threads
+ */
+typedef struct thrpool {
+  bool valid; ///< boolean indicating whether the pool is initialized
+  int num_workers;  ///< number of worker threads
+  thrpool_worker_t *workers;  ///< the worker threads
+  mutex_t pool_mutex; ///< protects the shared queue and parking
+  thrpool_task_queue_t shared_queue; ///< tasks submitted from outside the pool
+  volatile unsigned int num_parked;  ///< number of parked workers
+  volatile int shutdown;  ///< tells the workers to exit
+  thrpool_group_t all;  ///< every task submitted to the pool
+  cond_t idle_cv; ///< wakes non-worker threads waiting on a group
+} thrpool_t;
+
+#endif /* _THRPOOL_TYPE_H */
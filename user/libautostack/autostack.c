@@ -1,6 +1,12 @@
 /** @file autostack.c
  *  @brief autostack handler functions for legacy programs
  *
+ *  The first growth step maps as much as the initial stack, and every step
+ *  after that doubles, up to g_stack_max_grow, so a recursion of depth d
+ *  faults O(log d) times rather than O(d). A step is mapped below the
+ *  faulting page rather than below the old bottom of the stack, so a large
+ *  frame that skips pages is covered by a single fault too.
+ *
  *  @author Tianya Chen (andrewid: tianyac, email: tianyakc@gmail.com)
  */
 
@@ -10,13 +16,18 @@
 #include <syscall.h>
 #include <malloc.h>
 #include <thr_internals.h>
+#include <autostack.h>
 #include "swexn_internals.h"
 
 static uint32_t g_root_stk_high; ///< the lowest address of root stack 
 static uint32_t g_root_stk_low;  ///< the highest address of root stack 
 static uint32_t g_swexn_stk_high; ///< the highest address of swexn handler stack
 static uint32_t g_swexn_stk_low;  ///< the lowest of swexn handler stack
-static uint32_t g_stack_grow_size; ///< the fixed grow size for autostack handler
+static uint32_t g_stack_grow_size; ///< the size of the next growth step
+/// the cap of a growth step, see autostack_set_max_grow
+static uint32_t g_stack_max_grow = AUTOSTACK_DEFAULT_MAX_GROW;
+static uint32_t g_stack_peak_low; ///< the lowest address the stack faulted at
+static unsigned int g_stack_faults; ///< growth steps taken
 
 
 /** @brief get the highest address of root stack
@@ -33,6 +44,51 @@ uint32_t get_root_stack_low() {
     return g_root_stk_low;
 }
 
+/** @brief sets the cap of one growth step of the root stack
+ *  @param max_grow the cap in bytes, rounded up to whole pages
+ *  @returns void
+ */
+void autostack_set_max_grow(unsigned int max_grow) {
+    if (max_grow < PAGE_SIZE){
+      max_grow = PAGE_SIZE;
+    }
+    g_stack_max_grow = (max_grow + PAGE_SIZE - 1) & PAGE_ALIGN_MASK;
+    if (g_stack_grow_size > g_stack_max_grow){
+      g_stack_grow_size = g_stack_max_grow;
+    }
+}
+
+/** @brief get the peak depth of the root stack
+ *
+ *  a growth step maps well past the faulting address, so the lowest fault
+ *  alone can be a whole step short. new_pages hands out zeroed pages, so
+ *  the mapped part of the stack is scanned up from its bottom for the
+ *  first word ever written instead. Only zeros stored at the very bottom
+ *  of the deepest frame can hide from the scan, and never below the
+ *  lowest fault.
+ *
+ *  @returns the depth in bytes
+ */
+unsigned int autostack_peak_depth(void) {
+    volatile uint32_t *word = (volatile uint32_t *)g_root_stk_low;
+    while ((uint32_t)word < g_root_stk_high && *word == 0){
+      word++;
+    }
+
+    uint32_t peak_low = (uint32_t)word;
+    if (peak_low > g_stack_peak_low){
+      peak_low = g_stack_peak_low;
+    }
+    return g_root_stk_high - peak_low;
+}
+
+/** @brief get the number of times the root stack grew
+ *  @returns the number of growth steps
+ */
+unsigned int autostack_fault_count(void) {
+    return g_stack_faults;
+}
+
 /** @brief the autostack handler to handle exception and grow the stack
  *         for legacy programs
  *  @param arg gerenal type arg to put pass to the handler
@@ -45,11 +101,24 @@ void autostack_handler(void *arg, ureg_t *ureg){
   if (ureg->cause == SWEXN_CAUSE_PAGEFAULT){
     /* check if the page fault is within the current stack frame
        autostack growth only handles page fault within the current stack frame */
-    if (ureg->cr2 <= ureg->ebp && (ureg->cr2 + POINTER32) >= ureg->esp){
-      g_root_stk_low -= g_stack_grow_size;
-      if(new_pages((void *)g_root_stk_low, g_stack_grow_size) < 0){
+    if (ureg->cr2 <= ureg->ebp && (ureg->cr2 + POINTER32) >= ureg->esp &&
+        ureg->cr2 < g_root_stk_low){
+      /* map a whole step past the faulting page */
+      uint32_t new_low = (ureg->cr2 & PAGE_ALIGN_MASK) - g_stack_grow_size;
+      if (new_low > ureg->cr2 ||
+          new_pages((void *)new_low, g_root_stk_low - new_low) < 0){
         panic("autostack.c: can't allocate more memory to grow the stack.");
       }
+      g_root_stk_low = new_low;
+
+      if (ureg->cr2 < g_stack_peak_low){
+        g_stack_peak_low = ureg->cr2;
+      }
+      g_stack_faults++;
+
+      /* the next step doubles, up to the cap */
+      g_stack_grow_size = (g_stack_grow_size > g_stack_max_grow / 2) ?
+                          g_stack_max_grow : 2 * g_stack_grow_size;
 
       /* re-register the autostack handler */
       if(swexn(esp3, autostack_handler, arg, ureg) < 0){
@@ -73,6 +142,11 @@ void install_autostack(void *stack_high, void *stack_low){
   g_root_stk_low = (uint32_t)stack_low;
   g_stack_grow_size = (uint32_t) (stack_high - stack_low);
   g_stack_grow_size = round_up_stack_size(g_stack_grow_size);
+  if (g_stack_grow_size > g_stack_max_grow){
+    g_stack_grow_size = g_stack_max_grow;
+  }
+  g_stack_peak_low = g_root_stk_high;
+  g_stack_faults = 0;
 
   /* allocate the software handler stack on the heap. */
   void* swexn_stack_low = malloc(SWEXN_STACK_SIZE);
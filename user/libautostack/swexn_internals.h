@@ -25,14 +25,14 @@
 #define POINTER32 4 ///< increment of a 32 bit aligned pointer
 #endif
 
-/** @brief global pointer to swexn stack */
+/** @brief global pointer to the swexn stack of the autostack handler,
+ *  thr_init moves every thread to its own exception stack */
 void *esp3;
 
 uint32_t get_root_stack_low();
 uint32_t get_root_stack_high();
 void install_autostack(void * stack_high, void * stack_low);
 void autostack_handler(void *arg, ureg_t *ureg);
-void install_swexn(void);
 void swexn_handler(void *arg, ureg_t *ureg);
 
 #endif /* _AUTOSTACK_INTERNALS_H */
@@ -0,0 +1,161 @@
+/** @file barrier.c
+ *  @brief implementation of a sense-reversing barrier
+ *
+ *  Every thread arriving at the barrier reads the current sense and
+ *  counts itself off. The last one to arrive resets the count and flips
+ *  the sense, which opens the barrier for this round and arms it for the
+ *  next. The others first spin on the sense for a while, since on a busy
+ *  barrier the last thread is usually close behind, and then block on the
+ *  waiters queue. The last thread wakes only the first blocked thread,
+ *  and every woken thread wakes the one queued after it, so opening the
+ *  barrier costs its opener one make_runnable however many threads wait.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <barrier.h>
+#include "thr_internals.h"
+#include "mutex_private.h"
+#include "error_code.h"
+
+/** number of times a waiter checks the sense before it blocks */
+#define BARRIER_SPIN_COUNT 64
+
+/** @brief initializes a barrier
+ *  @param barrier pointer to the barrier to initialize
+ *  @param count the number of threads that meet at the barrier
+ *  @return 0 on success, negative number on failure
+ */
+int barrier_init( barrier_t *barrier, unsigned int count )
+{
+  if ( barrier == NULL )
+  {
+    printf("barrier_init: barrier pointer is NULL.\n");
+    return ERROR_NULL_POINTER;
+  }
+
+  if ( count == 0 )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  int ret = mutex_init( &(barrier->mutex) );
+  if ( ret < 0 )
+  {
+    return ret;
+  }
+
+  (barrier->count) = count;
+  (barrier->remaining) = count;
+  (barrier->sense) = 0;
+  Q_INIT_HEAD( &(barrier->waiters) );
+  (barrier->valid) = LOCK_INITIALIZED;
+
+  return SUCCESS_RETURN;
+}
+
+/** @brief destroys a barrier
+ *  @param barrier pointer to the barrier to destroy
+ *
+ *  requires no thread is waiting at the barrier
+ *
+ *  @return void
+ */
+void barrier_destroy( barrier_t *barrier )
+{
+  if ( barrier == NULL )
+  {
+    printf("barrier_destroy: barrier pointer is NULL.\n");
+    return;
+  }
+
+  if ( (barrier->remaining) != (barrier->count) ||
+       (barrier->waiters.size) != 0 )
+  {
+    printf("barrier_destroy: trying to destroy a barrier in use.\n");
+    return;
+  }
+
+  (barrier->valid) = LOCK_UNINITIALIZED;
+  mutex_destroy( &(barrier->mutex) );
+}
+
+/** @brief waits until count threads have called barrier_wait
+ *  @param barrier pointer to the barrier to wait at
+ *  @return BARRIER_SERIAL_THREAD to the last thread to arrive, which
+ *          opened the barrier, 0 to the others
+ */
+int barrier_wait( barrier_t *barrier )
+{
+  if ( barrier == NULL || (barrier->valid) != LOCK_INITIALIZED )
+  {
+    printf("barrier_wait: waiting on an uninitialized barrier.\n");
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  // the sense this round ends with
+  unsigned int my_sense = !atomic_load( &(barrier->sense) );
+
+  if ( atomic_decrement( &(barrier->remaining) ) == 1 )
+  {
+    // arm the next round before anyone can leave this one
+    (barrier->remaining) = (barrier->count);
+
+    mutex_lock( &(barrier->mutex) );
+    atomic_store( &(barrier->sense), my_sense );
+    thr_stack_meta_t* first = Q_GET_FRONT( &(barrier->waiters) );
+    Q_INIT_HEAD( &(barrier->waiters) );
+    mutex_unlock( &(barrier->mutex) );
+
+    if ( first != NULL )
+    {
+      wake_thread( first );
+    }
+    return BARRIER_SERIAL_THREAD;
+  }
+
+  int spin;
+  for ( spin = 0; spin < BARRIER_SPIN_COUNT; spin++ )
+  {
+    if ( atomic_load( &(barrier->sense) ) == my_sense )
+    {
+      return 0;
+    }
+    cpu_relax();
+  }
+
+  thr_stack_meta_t* self = find_current_thread_meta();
+  if ( self == NULL )
+  {
+    panic("barrier_wait: can't find its stack meta data.\n");
+  }
+
+  mutex_lock( &(barrier->mutex) );
+  if ( (barrier->sense) == my_sense )
+  {
+    mutex_unlock( &(barrier->mutex) );
+    return 0;
+  }
+  (self->wake_flag) = 0;
+  // inserting into an empty queue leaves the links alone, the last waiter
+  // of the round must not find the next it had in an earlier one
+  Q_INIT_ELEM( self, barrier_link );
+  Q_INSERT_TAIL( &(barrier->waiters), self, barrier_link );
+  mutex_unlock( &(barrier->mutex) );
+
+  wait_for_wake( self );
+
+  // pass the wakeup on, our link isn't touched again until we block on a
+  // barrier again, and the next thread can't leave before we wake it
+  thr_stack_meta_t* next = Q_GET_NEXT( self, barrier_link );
+  if ( next != NULL )
+  {
+    wake_thread( next );
+  }
+  return 0;
+}
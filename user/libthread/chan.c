@@ -0,0 +1,298 @@
+/** @file chan.c
+ *  @brief implementation of a lock-free bounded MPMC channel
+ *
+ *  The channel is a ring of cells, each with a sequence number telling
+ *  which lap of the ring it is on (Vyukov's bounded queue). A sender
+ *  claims the next send position with a compare and swap, once the cell
+ *  there is free on this lap, writes the message and publishes it by
+ *  bumping the cell's sequence. A receiver does the same with the receive
+ *  position, and bumps the sequence a full lap ahead to free the cell.
+ *  Neither takes a lock, and senders and receivers touch different words
+ *  except on the cell they hand over.
+ *
+ *  Only a blocking send on a full channel, or a blocking receive on an
+ *  empty one, goes to the mutex and condition variables. It announces
+ *  itself in the waiter count before its last try, and the other side
+ *  checks the count after each successful operation, so the mutex is
+ *  only taken when somebody actually sleeps.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <mutex.h>
+#include <cond.h>
+#include <chan.h>
+#include "thr_internals.h"
+#include "mutex_private.h"
+#include "error_code.h"
+
+/** smallest capacity of a channel */
+#define CHAN_MIN_CAPACITY 2
+
+/** @brief initializes a channel
+ *  @param chan pointer to the channel to initialize
+ *  @param capacity number of messages the channel holds, rounded up to a
+ *         power of two
+ *  @return 0 on success, negative number on failure
+ */
+int chan_init( chan_t *chan, unsigned int capacity )
+{
+  if ( chan == NULL )
+  {
+    printf("chan_init: channel pointer is NULL.\n");
+    return ERROR_NULL_POINTER;
+  }
+
+  if ( capacity == 0 || capacity > (1U << 30) )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  unsigned int size = CHAN_MIN_CAPACITY;
+  while ( size < capacity )
+  {
+    size <<= 1;
+  }
+
+  (chan->cells) = malloc( size * sizeof(chan_cell_t) );
+  if ( (chan->cells) == NULL )
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+
+  int ret = 0;
+  ret |= mutex_init( &(chan->mutex) );
+  ret |= cond_init( &(chan->not_full) );
+  ret |= cond_init( &(chan->not_empty) );
+  if ( ret < 0 )
+  {
+    free( chan->cells );
+    return ERROR_INIT_ON_USE;
+  }
+
+  unsigned int i;
+  for ( i = 0; i < size; i++ )
+  {
+    (chan->cells[i].seq) = i;
+    (chan->cells[i].msg) = NULL;
+  }
+
+  (chan->mask) = size - 1;
+  (chan->send_pos) = 0;
+  (chan->recv_pos) = 0;
+  (chan->send_waiters) = 0;
+  (chan->recv_waiters) = 0;
+  (chan->valid) = LOCK_INITIALIZED;
+
+  return SUCCESS_RETURN;
+}
+
+/** @brief destroys a channel, dropping any message still in it
+ *  @param chan pointer to the channel to destroy
+ *
+ *  requires no thread is using the channel
+ *
+ *  @return void
+ */
+void chan_destroy( chan_t *chan )
+{
+  if ( chan == NULL || (chan->valid) != LOCK_INITIALIZED )
+  {
+    printf("chan_destroy: destroying an uninitialized channel.\n");
+    return;
+  }
+
+  (chan->valid) = LOCK_UNINITIALIZED;
+  cond_destroy( &(chan->not_empty) );
+  cond_destroy( &(chan->not_full) );
+  mutex_destroy( &(chan->mutex) );
+  free( chan->cells );
+  (chan->cells) = NULL;
+}
+
+/** @brief wakes a thread blocked on the other side, if there is any
+ *  @param chan pointer to the channel
+ *  @param waiters waiter count of the other side
+ *  @param cv condition variable the other side blocks on
+ *  @return void
+ */
+static void chan_wake( chan_t *chan, volatile unsigned int *waiters, cond_t *cv )
+{
+  // the cell we just handed over must be visible before we look
+  memory_barrier();
+  if ( atomic_load( waiters ) == 0 )
+  {
+    return;
+  }
+
+  mutex_lock( &(chan->mutex) );
+  cond_signal( cv );
+  mutex_unlock( &(chan->mutex) );
+}
+
+/** @brief sends a message if the channel isn't full
+ *  @param chan pointer to the channel
+ *  @param msg the message
+ *  @return 0 on success, ERROR_WOULD_BLOCK if the channel is full
+ */
+static int chan_enqueue( chan_t *chan, void *msg )
+{
+  unsigned int pos = atomic_load( &(chan->send_pos) );
+  chan_cell_t *cell;
+
+  while ( 1 )
+  {
+    cell = &(chan->cells[pos & (chan->mask)]);
+    int dif = (int)(atomic_load( &(cell->seq) ) - pos);
+
+    if ( dif == 0 )
+    {
+      unsigned int old = atomic_compare_swap( &(chan->send_pos), pos, pos + 1 );
+      if ( old == pos )
+      {
+        break;
+      }
+      pos = old;
+    }
+    else if ( dif < 0 )
+    {
+      // the cell still holds the message from the previous lap
+      return ERROR_WOULD_BLOCK;
+    }
+    else
+    {
+      pos = atomic_load( &(chan->send_pos) );
+    }
+  }
+
+  (cell->msg) = msg;
+  atomic_store( &(cell->seq), pos + 1 );
+  return SUCCESS_RETURN;
+}
+
+/** @brief receives a message if the channel isn't empty
+ *  @param chan pointer to the channel
+ *  @param msg where to store the message
+ *  @return 0 on success, ERROR_WOULD_BLOCK if the channel is empty
+ */
+static int chan_dequeue( chan_t *chan, void **msg )
+{
+  unsigned int pos = atomic_load( &(chan->recv_pos) );
+  chan_cell_t *cell;
+
+  while ( 1 )
+  {
+    cell = &(chan->cells[pos & (chan->mask)]);
+    int dif = (int)(atomic_load( &(cell->seq) ) - (pos + 1));
+
+    if ( dif == 0 )
+    {
+      unsigned int old = atomic_compare_swap( &(chan->recv_pos), pos, pos + 1 );
+      if ( old == pos )
+      {
+        break;
+      }
+      pos = old;
+    }
+    else if ( dif < 0 )
+    {
+      // no message was published in the cell on this lap yet
+      return ERROR_WOULD_BLOCK;
+    }
+    else
+    {
+      pos = atomic_load( &(chan->recv_pos) );
+    }
+  }
+
+  *msg = (cell->msg);
+  atomic_store( &(cell->seq), pos + (chan->mask) + 1 );
+  return SUCCESS_RETURN;
+}
+
+/** @brief sends a message without blocking
+ *  @param chan pointer to the channel
+ *  @param msg the message
+ *  @return 0 on success, ERROR_WOULD_BLOCK if the channel is full
+ */
+int chan_try_send( chan_t *chan, void *msg )
+{
+  int ret = chan_enqueue( chan, msg );
+
+  if ( ret == SUCCESS_RETURN )
+  {
+    chan_wake( chan, &(chan->recv_waiters), &(chan->not_empty) );
+  }
+  return ret;
+}
+
+/** @brief receives a message without blocking
+ *  @param chan pointer to the channel
+ *  @param msg where to store the message
+ *  @return 0 on success, ERROR_WOULD_BLOCK if the channel is empty
+ */
+int chan_try_recv( chan_t *chan, void **msg )
+{
+  int ret = chan_dequeue( chan, msg );
+
+  if ( ret == SUCCESS_RETURN )
+  {
+    chan_wake( chan, &(chan->send_waiters), &(chan->not_full) );
+  }
+  return ret;
+}
+
+/** @brief sends a message, blocking while the channel is full
+ *  @param chan pointer to the channel
+ *  @param msg the message
+ *  @return void
+ */
+void chan_send( chan_t *chan, void *msg )
+{
+  if ( chan_try_send( chan, msg ) == SUCCESS_RETURN )
+  {
+    return;
+  }
+
+  mutex_lock( &(chan->mutex) );
+  // a locked increment, so a receiver freeing a cell after our last try
+  // is sure to see us
+  atomic_increment( &(chan->send_waiters) );
+  while ( chan_enqueue( chan, msg ) != SUCCESS_RETURN )
+  {
+    cond_wait( &(chan->not_full), &(chan->mutex) );
+  }
+  atomic_decrement( &(chan->send_waiters) );
+  mutex_unlock( &(chan->mutex) );
+
+  chan_wake( chan, &(chan->recv_waiters), &(chan->not_empty) );
+}
+
+/** @brief receives a message, blocking while the channel is empty
+ *  @param chan pointer to the channel
+ *  @return the message
+ */
+void *chan_recv( chan_t *chan )
+{
+  void *msg;
+
+  if ( chan_try_recv( chan, &msg ) == SUCCESS_RETURN )
+  {
+    return msg;
+  }
+
+  mutex_lock( &(chan->mutex) );
+  atomic_increment( &(chan->recv_waiters) );
+  while ( chan_dequeue( chan, &msg ) != SUCCESS_RETURN )
+  {
+    cond_wait( &(chan->not_empty), &(chan->mutex) );
+  }
+  atomic_decrement( &(chan->recv_waiters) );
+  mutex_unlock( &(chan->mutex) );
+
+  chan_wake( chan, &(chan->send_waiters), &(chan->not_full) );
+  return msg;
+}
@@ -7,10 +7,10 @@
 #include <contracts.h>
 #include <stddef.h>
 #include <simics.h>
-#include <malloc.h>
 #include <syscall.h>
 #include <thread.h>
 #include <cond.h>
+#include <sync_ext.h>
 #include "thr_internals.h"
 #include "variable_queue.h"
 #include "error_code.h"
@@ -21,8 +21,10 @@
  *        && cond_var_is_valid( cv )
  *        && thread_list_size_check( cv )
  *  @param cv a condition variable
+ *  @param mp the mutex the thread gives up while waiting
+ *  @return metadata of the calling thread
  */
-void append_thread( cond_t* cv )
+thr_stack_meta_t* append_thread( cond_t* cv, mutex_t* mp )
 {
   thr_stack_meta_t* new_thread = find_current_thread_meta();
 
@@ -32,8 +34,12 @@ void append_thread( cond_t* cv )
   }
 
   Q_INIT_ELEM(new_thread, cv_link);
+  (new_thread->wake_flag) = 0;
+  (new_thread->wait_mutex) = mp;
+  (new_thread->wait_state) = WAITING_ON_CV;
 
-  Q_INSERT_TAIL((cv->cond_queue), new_thread, cv_link);
+  Q_INSERT_TAIL( &(cv->cond_queue), new_thread, cv_link );
+  return new_thread;
 }
 
 /** @brief initializes the given condition variable
@@ -65,14 +71,8 @@ int cond_init( cond_t* cv )
     return ERROR_INIT_ON_USE;
   }
 
-  // allocate memory for cond_queue
-  cv->cond_queue = (cond_queue_t*)malloc(sizeof(cond_queue_t));
-  if ( cv->cond_queue == NULL){
-    return ERROR_MALLOC_FAILED;
-  }
-
   // initalize the cond_queue
-  Q_INIT_HEAD( cv->cond_queue );
+  Q_INIT_HEAD( &(cv->cond_queue) );
 
   // set valid flag to true
   (cv->valid) = COND_INITIALIZED;
@@ -99,22 +99,16 @@ void cond_destroy( cond_t* cv)
   }
 
   mutex_lock( &(cv->cond_mutex) );
-  if ( (cv->cond_queue) != NULL )
+  if ( (cv->cond_queue.size) != 0 )
   {
-    if ( (cv->cond_queue->size) != 0 )
-    {
-      mutex_unlock( &(cv->cond_mutex) );
-      printf( "cond_destroy: trying to destroy while thread queue is nonempty.\n" );
-      return;
-    }
+    mutex_unlock( &(cv->cond_mutex) );
+    printf( "cond_destroy: trying to destroy while thread queue is nonempty.\n" );
+    return;
   }
 
   (cv->valid) = COND_UNINITIALIZED;
   mutex_unlock( &(cv->cond_mutex) );
   mutex_destroy( &(cv->cond_mutex) );
-  free( cv->cond_queue );
-
-  cv->cond_queue = NULL;
 }
 
 /** @brief waits on the given condition variable and gives up the mutex
@@ -147,22 +141,83 @@ void cond_wait( cond_t* cv, mutex_t* mp )
   }
 
   // add to thread queue
-  append_thread( cv );
+  thr_stack_meta_t* self = append_thread( cv, mp );
   mutex_unlock( &(cv->cond_mutex) );
 
   // give up on our mutex to let
   // some other thread do work
   mutex_unlock( mp );
 
-  // deschedule oneself
-  // cv->cond_queue->tail->thr_state = NOTRUNNABLE;
-  int reject_val = 0;
-  deschedule( &reject_val );
+  // deschedule oneself, until cond_signal wakes us or, after a
+  // cond_broadcast, the unlock of mp that hands it over to us
+  wait_for_wake( self );
 
   // re-aquire lock
   mutex_lock( mp );
 }
 
+/** @brief waits on the given condition variable like cond_wait, giving
+ *         up at a deadline
+ *  @param cv pointer to the condition variable to wait on
+ *  @param mp pointer to the mutex to temporarily give up
+ *  @param deadline get_ticks() value at which to give up
+ *
+ *  mp is re-aquired before returning either way
+ *
+ *  @return 0 if signaled, ERROR_TIMED_OUT if the deadline passed first,
+ *          other negative number on invalid arguments
+ */
+int cond_timedwait( cond_t* cv, mutex_t* mp, unsigned int deadline )
+{
+  if ( NULL == cv || NULL == mp )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  mutex_lock( &(cv->cond_mutex) );
+  if ( (cv->valid) == COND_UNINITIALIZED )
+  {
+    mutex_unlock( &(cv->cond_mutex) );
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  thr_stack_meta_t* self = append_thread( cv, mp );
+  mutex_unlock( &(cv->cond_mutex) );
+  mutex_unlock( mp );
+
+  int ret = wait_for_wake_until( self, deadline );
+
+  if ( ret < 0 )
+  {
+    // a signal can still race the timeout, whoever takes us off our
+    // queue first decides the outcome
+    mutex_lock( &(cv->cond_mutex) );
+    if ( (self->wait_state) == WAITING_ON_CV )
+    {
+      Q_REMOVE( &(cv->cond_queue), self, cv_link );
+      (self->wait_state) = WAITING_NONE;
+    }
+    else
+    {
+      // broadcast already moved us, count it as a wake
+      ret = SUCCESS_RETURN;
+      if ( !mutex_unqueue( mp, self ) )
+      {
+        // taken off by a waker that is about to set our flag, it must
+        // not land on a later wait
+        while ( (self->wake_flag) != WAKE_SIGNALED )
+        {
+          thr_yield(YIELD_ANYONE);
+        }
+      }
+    }
+    mutex_unlock( &(cv->cond_mutex) );
+  }
+
+  mutex_lock( mp );
+  return ret;
+}
+
 /** @brief wakes one thread waiting on cv
  *  @param cv pointer to condition variable to wake a thread up from
  *
@@ -176,29 +231,20 @@ void cond_signal( cond_t* cv )
 {
   mutex_lock( &(cv->cond_mutex) );
 
-  if ( (cv->cond_queue->size) > 0 )
+  if ( (cv->cond_queue.size) > 0 )
   {
     // get front thread of the queue
-    thr_stack_meta_t* next_thread = Q_GET_FRONT( cv->cond_queue );
+    thr_stack_meta_t* next_thread = Q_GET_FRONT( &(cv->cond_queue) );
 
     // remove the front thread
-    Q_REMOVE( cv->cond_queue , next_thread, cv_link);
+    Q_REMOVE( &(cv->cond_queue), next_thread, cv_link);
+    (next_thread->wait_state) = WAITING_NONE;
 
-    assert( (cv->cond_queue->size) >= 0 );
+    assert( (cv->cond_queue.size) >= 0 );
 
     // schedule next thread
-    int next_tid = (next_thread->tid);
     mutex_unlock( &(cv->cond_mutex) );
-
-    while ( make_runnable( next_tid ) < 0 )
-    {
-      if ( find_thread_meta_by_tid( next_tid ) == NULL )
-      {
-        break;
-      }
-
-      thr_yield( next_tid );
-    }
+    wake_thread( next_thread );
   }
   else
   {
@@ -209,6 +255,12 @@ void cond_signal( cond_t* cv )
 /** @brief signals ALL the threads waiting on cv to wake up
  *  @param cv pointer to the condition variable to broadcast to
  *
+ *  Waking every waiter would only have them all contend for the mutex
+ *  they waited with. Only the front waiter is woken, the others are
+ *  moved onto the morph queue of their mutex and woken one per
+ *  mutex_unlock. A waiter that waited with a different mutex than the
+ *  front one is woken right away, so every mutex gets its chain started.
+ *
  *  requires cv != NULL
  *         && cond_var_is_valid( cv )
  *         && thread_list_size_check( cv )
@@ -218,23 +270,37 @@ void cond_signal( cond_t* cv )
 void cond_broadcast( cond_t* cv )
 {
   thr_stack_meta_t* next_thread = NULL;
-  // could implement this by just calling cond_signal a bunch of times
   mutex_lock( &(cv->cond_mutex) );
 
-  while ( (cv->cond_queue->size) > 0 )
+  thr_stack_meta_t* first_thread = Q_GET_FRONT( &(cv->cond_queue) );
+  if ( first_thread == NULL )
+  {
+    mutex_unlock( &(cv->cond_mutex) );
+    return;
+  }
+  Q_REMOVE( &(cv->cond_queue), first_thread, cv_link );
+  (first_thread->wait_state) = WAITING_NONE;
+
+  while ( (cv->cond_queue.size) > 0 )
   {
     // get front thread of the queue
-    next_thread = Q_GET_FRONT( cv->cond_queue );
+    next_thread = Q_GET_FRONT( &(cv->cond_queue) );
 
     // remove the front thread
-    Q_REMOVE( cv->cond_queue, next_thread, cv_link );
+    Q_REMOVE( &(cv->cond_queue), next_thread, cv_link );
 
-    // schedule next thread
-    int next_tid = (next_thread->tid);
-    while ( make_runnable( next_thread->tid ) )
+    // leave it asleep until its mutex is handed over
+    if ( (next_thread->wait_mutex) == (first_thread->wait_mutex) )
     {
-      thr_yield( next_tid );
+      mutex_requeue( next_thread->wait_mutex, next_thread );
+    }
+    else
+    {
+      (next_thread->wait_state) = WAITING_NONE;
+      wake_thread( next_thread );
     }
   }
   mutex_unlock( &(cv->cond_mutex) );
+
+  wake_thread( first_thread );
 }
@@ -28,3 +28,19 @@
 #define ERROR_MULTIPLE_JOINS -10
 /// indicates a synchronization primitive was initialized while occupied
 #define ERROR_INIT_ON_USE -11
+/// indicates a thread ran its stack into the guard page
+#define ERROR_STACK_OVERFLOW -12
+/// indicates an argument is out of its valid range
+#define ERROR_INVALID_ARGUMENT -13
+/// indicates a future was completed more than once
+#define ERROR_MULTIPLE_SETS -14
+/// indicates a wait gave up at its deadline
+#define ERROR_TIMED_OUT -15
+/// indicates a lock is held and the caller asked not to wait for it
+#define ERROR_WOULD_BLOCK -16
+/// indicates another reader is already upgrading the rwlock
+#define ERROR_UPGRADE_CONFLICT -17
+/// indicates every thread-local storage key is in use
+#define ERROR_NO_KEYS -18
+/// indicates the library was built without the requested feature
+#define ERROR_NOT_SUPPORTED -19
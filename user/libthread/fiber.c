@@ -0,0 +1,559 @@
+/** @file fiber.c
+ *  @brief implementation of user-level fibers multiplexed onto a small
+ *         number of carrier threads
+ *
+ *  A fiber runs on its own small stack and switches with fiber_switch,
+ *  which saves only the callee saved registers and the stack pointer, so
+ *  yielding between fibers never enters the kernel. Each carrier thread
+ *  loops taking fibers off a shared run queue and switching into them.
+ *  When a fiber yields, blocks or finishes it switches back to its
+ *  carrier, and the carrier requeues or retires it once it is off the
+ *  fiber's stack. Idle carriers park with deschedule.
+ *
+ *  Fibers don't have thread metadata, so they must not block in
+ *  cond_wait, sem_wait, rwlock_lock or thr_join; they can use mutexes,
+ *  malloc and fiber_join/fiber_yield.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <syscall.h>
+#include <syscall_inline.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond.h>
+#include <fiber.h>
+#include "thr_internals.h"
+#include "mutex_private.h"
+#include "error_code.h"
+
+/** value of the magic field of a live fiber */
+#define FIBER_MAGIC 0xF1BE4F1B
+
+/** a kernel thread that runs fibers
+ */
+typedef struct fiber_carrier {
+  int tid;            ///< thread id of the carrier
+  bool parked;        ///< whether the carrier waits for fibers to run
+  volatile int wake;  ///< deschedule reject flag for waking a parked carrier
+  uint32_t esp;       ///< saved stack pointer of the carrier's loop
+} fiber_carrier_t;
+
+/// declares the fiber run queue type
+Q_NEW_HEAD(fiber_queue_t, fiber);
+
+static bool g_fiber_initialized = false; ///< whether fiber_init has run
+static mutex_t g_fiber_mutex; ///< protects everything below
+static fiber_queue_t g_fiber_run_queue; ///< fibers ready to run
+static fiber_carrier_t *g_fiber_carriers; ///< the carrier threads
+static int g_fiber_num_carriers; ///< number of carrier threads
+static unsigned int g_fiber_num_parked; ///< number of parked carriers
+static int g_fiber_live; ///< number of fibers that haven't finished
+static int g_fiber_shutdown; ///< tells the carriers to exit
+static cond_t g_fiber_done_cv; ///< wakes threads waiting on a fiber to finish
+
+/** @brief switches from one saved stack pointer to another
+ *  @param save_esp where to save the current stack pointer
+ *  @param load_esp pointer to the stack pointer to switch to
+ *  @return when the saved context is switched back to
+ */
+void fiber_switch(uint32_t *save_esp, uint32_t *load_esp);
+
+/** @brief finds the fiber the caller is running on
+ *  @return the calling fiber, NULL if the caller is a regular thread
+ */
+static fiber_t *fiber_self(void)
+{
+  if ( find_current_thread_meta() != NULL )
+  {
+    return NULL;
+  }
+
+  uint32_t stack_low = read_ebp() & ~(FIBER_STACK_SIZE - 1);
+  fiber_t *fiber = (fiber_t *)(stack_low + FIBER_STACK_SIZE - sizeof(fiber_t));
+
+  if ( fiber->magic != FIBER_MAGIC )
+  {
+    return NULL;
+  }
+  return fiber;
+}
+
+/** @brief puts a fiber on the run queue and picks a parked carrier for it
+ *  @param fiber the fiber to run
+ *
+ *  requires caller owns g_fiber_mutex
+ *
+ *  @return a carrier the caller must make_runnable after unlocking, or NULL
+ */
+static fiber_carrier_t *enqueue_fiber(fiber_t *fiber)
+{
+  (fiber->state) = FIBER_READY;
+  Q_INSERT_TAIL( &g_fiber_run_queue, fiber, run_link );
+
+  if ( g_fiber_num_parked == 0 )
+  {
+    return NULL;
+  }
+
+  int i;
+  for ( i = 0; i < g_fiber_num_carriers; i++ )
+  {
+    fiber_carrier_t *carrier = &g_fiber_carriers[i];
+    if ( carrier->parked )
+    {
+      (carrier->parked) = false;
+      (carrier->wake) = 1;
+      g_fiber_num_parked -= 1;
+      return carrier;
+    }
+  }
+  return NULL;
+}
+
+/** @brief wakes a carrier picked by enqueue_fiber
+ *  @param carrier the carrier, may be NULL
+ *  @return void
+ */
+static void wake_carrier(fiber_carrier_t *carrier)
+{
+  // the wake flag covers the case where the carrier hasn't descheduled yet
+  if ( carrier != NULL )
+  {
+    inline_make_runnable( carrier->tid );
+  }
+}
+
+/** @brief frees the stack, and with it the struct, of a finished fiber
+ *  @param fiber the fiber to free
+ *  @return void
+ */
+static void free_fiber(fiber_t *fiber)
+{
+  (fiber->magic) = 0;
+  free( (void *)((uint32_t)fiber + sizeof(fiber_t) - FIBER_STACK_SIZE) );
+}
+
+/** @brief switches from the calling fiber back to its carrier
+ *  @param self the calling fiber, its state says why it switches out
+ *  @return when the fiber is switched back in
+ */
+static void switch_to_carrier(fiber_t *self)
+{
+  fiber_switch( &(self->esp), &(self->carrier->esp) );
+}
+
+/** @brief finishes the switch out of a fiber on the carrier's stack
+ *  @param fiber the fiber that switched back to the carrier
+ *
+ *  this runs once the fiber is no longer on its own stack, so the fiber
+ *  can safely be picked up by another carrier or freed
+ *
+ *  @return void
+ */
+static void retire_fiber(fiber_t *fiber)
+{
+  fiber_carrier_t *to_wake = NULL;
+  bool free_now = false;
+
+  mutex_lock( &g_fiber_mutex );
+  switch ( fiber->state )
+  {
+    case FIBER_RUNNING:
+      // fiber_yield
+      Q_INSERT_TAIL( &g_fiber_run_queue, fiber, run_link );
+      (fiber->state) = FIBER_READY;
+      break;
+    case FIBER_BLOCKED:
+      // fiber_join, the target may have finished while we switched
+      if ( fiber->join_target->state == FIBER_DONE )
+      {
+        to_wake = enqueue_fiber( fiber );
+      }
+      else
+      {
+        (fiber->join_target->joiner) = fiber;
+      }
+      break;
+    case FIBER_EXITING:
+      (fiber->state) = FIBER_DONE;
+      g_fiber_live -= 1;
+      if ( fiber->joiner != NULL )
+      {
+        to_wake = enqueue_fiber( fiber->joiner );
+        (fiber->joiner) = NULL;
+      }
+      free_now = (fiber->detached);
+      cond_broadcast( &g_fiber_done_cv );
+      break;
+    default:
+      break;
+  }
+  mutex_unlock( &g_fiber_mutex );
+
+  wake_carrier( to_wake );
+  if ( free_now )
+  {
+    free_fiber( fiber );
+  }
+}
+
+/** @brief parks a carrier until a fiber is ready to run
+ *  @param carrier the calling carrier
+ *
+ *  requires caller owns g_fiber_mutex, it is released on return
+ *
+ *  @return void
+ */
+static void park_carrier(fiber_carrier_t *carrier)
+{
+  (carrier->wake) = 0;
+  (carrier->parked) = true;
+  g_fiber_num_parked += 1;
+  mutex_unlock( &g_fiber_mutex );
+
+  while ( !(carrier->wake) )
+  {
+    inline_deschedule( (int *)&(carrier->wake) );
+  }
+}
+
+/** @brief main loop of a carrier thread
+ *  @param arg the carrier the thread runs as
+ *  @return NULL once the fibers shut down
+ */
+static void *carrier_main(void *arg)
+{
+  fiber_carrier_t *carrier = (fiber_carrier_t *) arg;
+  (carrier->tid) = thr_getid();
+
+  while ( true )
+  {
+    mutex_lock( &g_fiber_mutex );
+    fiber_t *fiber = Q_GET_FRONT( &g_fiber_run_queue );
+    if ( fiber == NULL )
+    {
+      if ( g_fiber_shutdown )
+      {
+        mutex_unlock( &g_fiber_mutex );
+        break;
+      }
+      park_carrier( carrier );
+      continue;
+    }
+    Q_REMOVE( &g_fiber_run_queue, fiber, run_link );
+    (fiber->state) = FIBER_RUNNING;
+    (fiber->carrier) = carrier;
+    mutex_unlock( &g_fiber_mutex );
+
+    fiber_switch( &(carrier->esp), &(fiber->esp) );
+    retire_fiber( fiber );
+  }
+  return NULL;
+}
+
+/** @brief first function that runs on a new fiber's stack
+ *  @param fiber the new fiber
+ *  @return never returns
+ */
+static void fiber_entry(fiber_t *fiber)
+{
+  (fiber->func)( fiber->arg );
+  fiber_exit();
+}
+
+/** @brief stops and joins the first num_started carriers
+ *  @param num_started the number of carriers that were created
+ *  @return void
+ */
+static void stop_carriers(int num_started)
+{
+  int i;
+
+  mutex_lock( &g_fiber_mutex );
+  g_fiber_shutdown = 1;
+  for ( i = 0; i < g_fiber_num_carriers; i++ )
+  {
+    (g_fiber_carriers[i].parked) = false;
+    (g_fiber_carriers[i].wake) = 1;
+  }
+  g_fiber_num_parked = 0;
+  mutex_unlock( &g_fiber_mutex );
+
+  for ( i = 0; i < num_started; i++ )
+  {
+    inline_make_runnable( g_fiber_carriers[i].tid );
+  }
+  for ( i = 0; i < num_started; i++ )
+  {
+    thr_join( g_fiber_carriers[i].tid, NULL );
+  }
+}
+
+/** @brief starts the carrier threads that run fibers
+ *  @param num_carriers the number of carrier threads
+ *
+ *  requires thr_init has been called
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int fiber_init( int num_carriers )
+{
+  if ( g_fiber_initialized )
+  {
+    return ERROR_DOUBLE_INITIALIZATION;
+  }
+
+  if ( num_carriers <= 0 )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  int ret = 0;
+  ret |= mutex_init( &g_fiber_mutex );
+  ret |= cond_init( &g_fiber_done_cv );
+  if ( ret < 0 )
+  {
+    return ERROR_INIT_ON_USE;
+  }
+
+  g_fiber_carriers = calloc( num_carriers, sizeof(fiber_carrier_t) );
+  if ( g_fiber_carriers == NULL )
+  {
+    cond_destroy( &g_fiber_done_cv );
+    mutex_destroy( &g_fiber_mutex );
+    return ERROR_MALLOC_FAILED;
+  }
+
+  Q_INIT_HEAD( &g_fiber_run_queue );
+  g_fiber_num_carriers = num_carriers;
+  g_fiber_num_parked = 0;
+  g_fiber_live = 0;
+  g_fiber_shutdown = 0;
+
+  int i;
+  for ( i = 0; i < num_carriers; i++ )
+  {
+    g_fiber_carriers[i].tid = UNSIGNED_TID;
+  }
+
+  for ( i = 0; i < num_carriers; i++ )
+  {
+    int tid = thr_create( carrier_main, &g_fiber_carriers[i] );
+    if ( tid < 0 )
+    {
+      stop_carriers( i );
+      free( g_fiber_carriers );
+      cond_destroy( &g_fiber_done_cv );
+      mutex_destroy( &g_fiber_mutex );
+      return ERROR_THR_CREATE_FAILED;
+    }
+    g_fiber_carriers[i].tid = tid;
+  }
+
+  g_fiber_initialized = true;
+  return SUCCESS_RETURN;
+}
+
+/** @brief waits for every fiber to finish, then stops the carriers
+ *
+ *  requires the caller is a regular thread, not a fiber
+ *
+ *  @return void
+ */
+void fiber_shutdown( void )
+{
+  if ( !g_fiber_initialized )
+  {
+    return;
+  }
+
+  mutex_lock( &g_fiber_mutex );
+  while ( g_fiber_live > 0 )
+  {
+    cond_wait( &g_fiber_done_cv, &g_fiber_mutex );
+  }
+  mutex_unlock( &g_fiber_mutex );
+
+  stop_carriers( g_fiber_num_carriers );
+
+  g_fiber_initialized = false;
+  free( g_fiber_carriers );
+  g_fiber_carriers = NULL;
+  cond_destroy( &g_fiber_done_cv );
+  mutex_destroy( &g_fiber_mutex );
+}
+
+/** @brief creates a new fiber and makes it ready to run
+ *  @param func function the fiber starts in
+ *  @param arg argument to pass to func
+ *  @return the new fiber on success, NULL on failure
+ */
+fiber_t *fiber_create( void (*func)(void *), void *arg )
+{
+  if ( !g_fiber_initialized || func == NULL )
+  {
+    return NULL;
+  }
+
+  void *stack_low = memalign( FIBER_STACK_SIZE, FIBER_STACK_SIZE );
+  if ( stack_low == NULL )
+  {
+    return NULL;
+  }
+
+  fiber_t *fiber = (fiber_t *)((uint32_t)stack_low + FIBER_STACK_SIZE -
+                               sizeof(fiber_t));
+  Q_INIT_ELEM( fiber, run_link );
+  (fiber->func) = func;
+  (fiber->arg) = arg;
+  (fiber->detached) = false;
+  (fiber->joined) = false;
+  (fiber->joiner) = NULL;
+  (fiber->join_target) = NULL;
+  (fiber->carrier) = NULL;
+  (fiber->magic) = FIBER_MAGIC;
+
+  // build the frame fiber_switch returns through into fiber_entry(fiber)
+  uint32_t *esp = (uint32_t *)fiber;
+  *(--esp) = (uint32_t) fiber;        // argument of fiber_entry
+  *(--esp) = 0;                       // fiber_entry never returns
+  *(--esp) = (uint32_t) fiber_entry;  // popped by the ret of fiber_switch
+  *(--esp) = 0;                       // %ebp
+  *(--esp) = 0;                       // %ebx
+  *(--esp) = 0;                       // %esi
+  *(--esp) = 0;                       // %edi
+  (fiber->esp) = (uint32_t) esp;
+
+  mutex_lock( &g_fiber_mutex );
+  g_fiber_live += 1;
+  fiber_carrier_t *to_wake = enqueue_fiber( fiber );
+  mutex_unlock( &g_fiber_mutex );
+
+  wake_carrier( to_wake );
+  return fiber;
+}
+
+/** @brief lets another fiber run on the calling fiber's carrier
+ *
+ *  yields the whole thread when the caller is not a fiber
+ *
+ *  @return void
+ */
+void fiber_yield( void )
+{
+  fiber_t *self = fiber_self();
+  if ( self == NULL )
+  {
+    thr_yield( YIELD_ANYONE );
+    return;
+  }
+
+  switch_to_carrier( self );
+}
+
+/** @brief finishes the calling fiber
+ *
+ *  requires the caller is a fiber
+ *
+ *  @return never returns
+ */
+void fiber_exit( void )
+{
+  fiber_t *self = fiber_self();
+  if ( self == NULL )
+  {
+    panic("fiber_exit: called outside of a fiber.");
+  }
+
+  (self->state) = FIBER_EXITING;
+  switch_to_carrier( self );
+  panic("fiber_exit: finished fiber was switched back in.");
+}
+
+/** @brief waits for a fiber to finish and frees it
+ *  @param fiber the fiber to wait on
+ *
+ *  a fiber caller blocks only itself, its carrier keeps running other
+ *  fibers; a regular thread caller blocks on a condition variable
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int fiber_join( fiber_t *fiber )
+{
+  if ( fiber == NULL || fiber->magic != FIBER_MAGIC )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  fiber_t *self = fiber_self();
+  if ( self == fiber )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  mutex_lock( &g_fiber_mutex );
+  if ( fiber->detached || fiber->joined )
+  {
+    mutex_unlock( &g_fiber_mutex );
+    return ERROR_MULTIPLE_JOINS;
+  }
+  (fiber->joined) = true;
+
+  if ( self == NULL )
+  {
+    while ( fiber->state != FIBER_DONE )
+    {
+      cond_wait( &g_fiber_done_cv, &g_fiber_mutex );
+    }
+    mutex_unlock( &g_fiber_mutex );
+  }
+  else
+  {
+    bool done = (fiber->state == FIBER_DONE);
+    mutex_unlock( &g_fiber_mutex );
+
+    if ( !done )
+    {
+      // the carrier links us to the target once we are off our stack
+      (self->join_target) = fiber;
+      (self->state) = FIBER_BLOCKED;
+      switch_to_carrier( self );
+      (self->join_target) = NULL;
+    }
+  }
+
+  free_fiber( fiber );
+  return SUCCESS_RETURN;
+}
+
+/** @brief lets a fiber free itself when it finishes
+ *  @param fiber the fiber nobody will join
+ *  @return 0 on success, negative number on failure
+ */
+int fiber_detach( fiber_t *fiber )
+{
+  if ( fiber == NULL || fiber->magic != FIBER_MAGIC )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  mutex_lock( &g_fiber_mutex );
+  if ( fiber->detached || fiber->joined )
+  {
+    mutex_unlock( &g_fiber_mutex );
+    return ERROR_MULTIPLE_JOINS;
+  }
+  (fiber->detached) = true;
+  bool done = (fiber->state == FIBER_DONE);
+  mutex_unlock( &g_fiber_mutex );
+
+  if ( done )
+  {
+    free_fiber( fiber );
+  }
+  return SUCCESS_RETURN;
+}
@@ -0,0 +1,342 @@
+/** @file future.c
+ *  @brief implementation of futures with continuation chaining
+ *
+ *  A future is completed once with future_set. Threads can block on it
+ *  with future_get, but the cheaper way to consume a value is to chain a
+ *  continuation with future_then: it runs right when the value is set,
+ *  either inline in the completing thread or as a task on a thread pool,
+ *  and its return value completes the next future in the chain. No step
+ *  of a pipeline needs its own thread or its own join.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <mutex.h>
+#include <cond.h>
+#include <thrpool.h>
+#include <future.h>
+#include "error_code.h"
+
+/** an asynchronous call started by future_async
+ */
+typedef struct future_call {
+  void *(*func)(void *);  ///< function to call
+  void *arg;              ///< argument passed to func
+  future_t *result;       ///< future completed with func's return
+} future_call_t;
+
+/** @brief runs a continuation and completes its result future
+ *  @param arg the continuation, freed here
+ *  @return void
+ */
+static void run_cont(void *arg)
+{
+  future_cont_t *cont = (future_cont_t *) arg;
+  void *ret = (cont->func)( cont->value, cont->arg );
+
+  if ( cont->result != NULL )
+  {
+    future_set( cont->result, ret );
+  }
+  free( cont );
+}
+
+/** @brief runs a continuation inline or hands it to its pool
+ *  @param cont the continuation
+ *  @param value the value of the completed future
+ *  @return void
+ */
+static void dispatch_cont(future_cont_t *cont, void *value)
+{
+  (cont->value) = value;
+
+  if ( cont->pool == NULL || thrpool_submit( cont->pool, NULL, run_cont, cont ) < 0 )
+  {
+    run_cont( cont );
+  }
+}
+
+/** @brief adds a continuation to a future, running it now if it's ready
+ *  @param future the future to wait on
+ *  @param cont the continuation
+ *  @return void
+ */
+static void add_cont(future_t *future, future_cont_t *cont)
+{
+  mutex_lock( &(future->mutex) );
+  if ( future->ready )
+  {
+    void *value = (future->value);
+    mutex_unlock( &(future->mutex) );
+    dispatch_cont( cont, value );
+    return;
+  }
+  Q_INSERT_TAIL( &(future->conts), cont, cont_link );
+  mutex_unlock( &(future->mutex) );
+}
+
+/** @brief creates an uncompleted future, the promise side of which is
+ *         future_set
+ *  @return the future on success, NULL on failure
+ */
+future_t *future_create( void )
+{
+  future_t *future = calloc( 1, sizeof(future_t) );
+  if ( future == NULL )
+  {
+    return NULL;
+  }
+
+  int ret = 0;
+  ret |= mutex_init( &(future->mutex) );
+  ret |= cond_init( &(future->cv) );
+  if ( ret < 0 )
+  {
+    free( future );
+    return NULL;
+  }
+
+  (future->ready) = false;
+  (future->value) = NULL;
+  (future->remaining) = 0;
+  Q_INIT_HEAD( &(future->conts) );
+  return future;
+}
+
+/** @brief frees a future
+ *  @param future the future to free
+ *
+ *  requires nobody waits on the future and no continuation still
+ *  has to complete it
+ *
+ *  @return void
+ */
+void future_free( future_t *future )
+{
+  if ( future == NULL )
+  {
+    return;
+  }
+
+  cond_destroy( &(future->cv) );
+  mutex_destroy( &(future->mutex) );
+  free( future );
+}
+
+/** @brief completes a future and runs its continuations
+ *  @param future the future to complete
+ *  @param value the value of the future
+ *  @return 0 on success, negative number if the future was already set
+ */
+int future_set( future_t *future, void *value )
+{
+  if ( future == NULL )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  mutex_lock( &(future->mutex) );
+  if ( future->ready )
+  {
+    mutex_unlock( &(future->mutex) );
+    return ERROR_MULTIPLE_SETS;
+  }
+
+  (future->value) = value;
+  (future->ready) = true;
+
+  // take the continuations, nothing can be added to the list any more
+  future_cont_t *cont = Q_GET_FRONT( &(future->conts) );
+  Q_INIT_HEAD( &(future->conts) );
+
+  cond_broadcast( &(future->cv) );
+  mutex_unlock( &(future->mutex) );
+
+  while ( cont != NULL )
+  {
+    future_cont_t *next = Q_GET_NEXT( cont, cont_link );
+    dispatch_cont( cont, value );
+    cont = next;
+  }
+  return SUCCESS_RETURN;
+}
+
+/** @brief waits for a future to complete
+ *  @param future the future to wait on
+ *  @return the value of the future
+ */
+void *future_get( future_t *future )
+{
+  mutex_lock( &(future->mutex) );
+  while ( !(future->ready) )
+  {
+    cond_wait( &(future->cv), &(future->mutex) );
+  }
+  void *value = (future->value);
+  mutex_unlock( &(future->mutex) );
+
+  return value;
+}
+
+/** @brief checks whether a future has completed, without blocking
+ *  @param future the future to check
+ *  @return true if future_get would return right away
+ */
+bool future_is_ready( future_t *future )
+{
+  return (future->ready);
+}
+
+/** @brief pool task that runs an asynchronous call
+ *  @param arg the call, freed here
+ *  @return void
+ */
+static void run_call(void *arg)
+{
+  future_call_t *call = (future_call_t *) arg;
+  future_set( call->result, (call->func)( call->arg ) );
+  free( call );
+}
+
+/** @brief runs a function on a pool and returns a future of its result
+ *  @param pool the pool to run func on, NULL runs it inline
+ *  @param func the function to run
+ *  @param arg argument passed to func
+ *  @return the future on success, NULL on failure
+ */
+future_t *future_async( thrpool_t *pool, void *(*func)(void *), void *arg )
+{
+  future_t *result = future_create();
+  future_call_t *call = malloc( sizeof(future_call_t) );
+  if ( result == NULL || call == NULL )
+  {
+    future_free( result );
+    free( call );
+    return NULL;
+  }
+
+  (call->func) = func;
+  (call->arg) = arg;
+  (call->result) = result;
+
+  if ( pool == NULL || thrpool_submit( pool, NULL, run_call, call ) < 0 )
+  {
+    run_call( call );
+  }
+  return result;
+}
+
+/** @brief chains a continuation onto a future
+ *  @param future the future whose value the continuation consumes
+ *  @param pool the pool to run func on, NULL runs it inline in the thread
+ *         that completes future
+ *  @param func the continuation, called with the value of future and arg
+ *  @param arg second argument passed to func
+ *  @return a future of func's return on success, NULL on failure
+ */
+future_t *future_then( future_t *future, thrpool_t *pool,
+                       void *(*func)(void *value, void *arg), void *arg )
+{
+  if ( future == NULL || func == NULL )
+  {
+    return NULL;
+  }
+
+  future_t *result = future_create();
+  future_cont_t *cont = malloc( sizeof(future_cont_t) );
+  if ( result == NULL || cont == NULL )
+  {
+    future_free( result );
+    free( cont );
+    return NULL;
+  }
+
+  Q_INIT_ELEM( cont, cont_link );
+  (cont->func) = func;
+  (cont->arg) = arg;
+  (cont->value) = NULL;
+  (cont->result) = result;
+  (cont->pool) = pool;
+
+  add_cont( future, cont );
+  return result;
+}
+
+/** @brief continuation counting down a future_when_all future
+ *  @param value the value of one of the awaited futures, unused
+ *  @param arg the future_when_all future
+ *  @return NULL
+ */
+static void *when_all_step(void *value, void *arg)
+{
+  future_t *all = (future_t *) arg;
+
+  mutex_lock( &(all->mutex) );
+  (all->remaining) -= 1;
+  bool last = ((all->remaining) == 0);
+  mutex_unlock( &(all->mutex) );
+
+  if ( last )
+  {
+    future_set( all, NULL );
+  }
+  return NULL;
+}
+
+/** @brief returns a future that completes once all the given futures have
+ *  @param futures the futures to wait for
+ *  @param count the number of futures
+ *
+ *  the returned future's value is NULL, the values themselves can be read
+ *  with future_get on each of the given futures without blocking
+ *
+ *  @return the future on success, NULL on failure
+ */
+future_t *future_when_all( future_t **futures, int count )
+{
+  if ( (futures == NULL && count > 0) || count < 0 )
+  {
+    return NULL;
+  }
+
+  future_t *all = future_create();
+  if ( all == NULL )
+  {
+    return NULL;
+  }
+
+  // count ourselves too, so the future can't complete before every
+  // continuation is in place
+  (all->remaining) = count + 1;
+
+  int i;
+  for ( i = 0; i < count; i++ )
+  {
+    future_cont_t *cont = malloc( sizeof(future_cont_t) );
+    if ( cont == NULL )
+    {
+      // can't unhook the continuations already added, wait them out
+      while ( i < count )
+      {
+        future_get( futures[i] );
+        when_all_step( NULL, all );
+        i++;
+      }
+      break;
+    }
+
+    Q_INIT_ELEM( cont, cont_link );
+    (cont->func) = when_all_step;
+    (cont->arg) = all;
+    (cont->value) = NULL;
+    (cont->result) = NULL;
+    (cont->pool) = NULL;
+    add_cont( futures[i], cont );
+  }
+
+  when_all_step( NULL, all );
+  return all;
+}
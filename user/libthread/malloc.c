@@ -2,24 +2,423 @@
  *  @brief C standard memory allocation functions but with a mutex wrapper
  *         to make them thread safe
  *
- * Assuming a correct mutex implementation, these are definitely thread safe.
- * Just potentially slow because we can't do anything but wrap the functions in
- * a mutex.
+ * The underlying _malloc heap is not thread safe, so every call into it is
+ * made under heap_mutex. To keep most calls off that lock, small requests
+ * are rounded up to one of MALLOC_NUM_CLASSES size classes and served from
+ * a cache of free blocks kept per thread (a thread-local storage key holds
+ * the cache). An empty cache is refilled with MALLOC_BATCH blocks in one
+ * trip to the heap, and a cache past MALLOC_CACHE_MAX blocks of a class
+ * gives half of them back in one trip. Large requests go straight to the
+ * heap.
+ *
+ * Every block carries a malloc_header_t in front of it, so free() knows
+ * whether the block belongs in a cache and realloc() knows its size.
+ * smalloc() and smemalign() blocks are the exception: the caller passes
+ * the size back to sfree(), so they are bare, and the small ones come from
+ * a second set of per-thread lists whose blocks are aligned to their
+ * class size.
+ *
+ * Built with MALLOC_STATS defined, the wrappers also count live and peak
+ * bytes, blocks per size class, and allocations per call site, see
+ * malloc_stats.h. The counters are updated with atomic instructions, so
+ * the instrumented build takes no extra lock.
  *
  * @author Carlos Montemayor (andrewid: cmontema, email: carl6256@gmail.com)
+ * @author Tianya Chen       (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
+#include <simics.h>
+#include <string.h>
 #include <types.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <error_code.h>
 #include <mutex.h>
+#include <atomic.h>
+#include <thread_ext.h>
+#include <malloc_stats.h>
 #include <thr_internals.h>
 
+/** blocks fetched from the heap when a cache runs empty */
+#define MALLOC_BATCH 16
+/** blocks of one class a cache may hold before giving half back */
+#define MALLOC_CACHE_MAX 64
+/** header info of a block that is not in a size class */
+#define MALLOC_CLASS_LARGE 0xFFFFFFFF
+/** header info flag of a memalign block, the rest is its offset */
+#define MALLOC_ALIGNED 0x80000000
+
+/** size of a block of size class c */
+#define MALLOC_CLASS_SIZE(c) (1U << ((c) + MALLOC_MIN_CLASS_SHIFT))
+
+/** kept in front of every block handed out, 8 bytes so blocks stay
+ *  8-byte aligned
+ */
+typedef struct malloc_header {
+  size_t size;        ///< bytes requested
+  unsigned int info;  ///< size class, MALLOC_CLASS_LARGE or MALLOC_ALIGNED
+} malloc_header_t;
+
+/** a free block in a cache, linked through its payload
+ */
+typedef struct malloc_free_block {
+  struct malloc_free_block *next;  ///< next free block of the same class
+} malloc_free_block_t;
+
+/** free blocks of one size class
+ */
+typedef struct malloc_free_list {
+  malloc_free_block_t *head;  ///< first free block, NULL if empty
+  unsigned int count;         ///< length of the list
+} malloc_free_list_t;
+
+/** free blocks of one thread, by size class
+ */
+typedef struct malloc_cache {
+  /// blocks with a malloc_header_t, handed out by malloc and friends
+  malloc_free_list_t headed[MALLOC_NUM_CLASSES];
+  /// bare blocks aligned to their size, handed out by smalloc and smemalign
+  malloc_free_list_t sized[MALLOC_NUM_CLASSES];
+} malloc_cache_t;
+
 static mutex_t heap_mutex; ///< mutex protecting non-safe allocation functions
 static bool mutex_initialized = false; ///< indicates multi-threading has begun
+static bool caches_enabled = false; ///< indicates malloc_key is valid
+static thr_key_t malloc_key; ///< thread-local key of each thread's cache
+
+#ifdef MALLOC_STATS
+
+static malloc_stats_t stats; ///< counters, updated with atomic instructions
+
+/** return address into the caller of the function using it */
+#define MALLOC_CALLER() (((unsigned int *) read_ebp())[1])
+
+/** @brief counts a request against its call site
+ *  @param site return address into the caller of the wrapper
+ *  @param size bytes requested
+ *
+ *  the table is open addressed, a free slot is claimed by a compare and
+ *  swap on its site so two threads never count one site in two slots
+ *
+ *  @return void
+ */
+static void stats_site(unsigned int site, size_t size)
+{
+  unsigned int start = (site >> 2) % MALLOC_STATS_SITES;
+  unsigned int i;
+
+  for ( i = 0; i < MALLOC_STATS_SITES; i++ )
+  {
+    malloc_site_stats_t *slot = &(stats.sites[(start + i) % MALLOC_STATS_SITES]);
+    unsigned int owner = atomic_load( (volatile unsigned int *) &(slot->site) );
+
+    if ( owner == 0 )
+    {
+      owner = atomic_compare_swap( (volatile unsigned int *) &(slot->site), 0, site );
+      owner = ( owner == 0 ) ? site : owner;
+    }
+
+    if ( owner == site )
+    {
+      atomic_increment( (volatile unsigned int *) &(slot->allocs) );
+      atomic_fetch_add( (volatile int *) &(slot->bytes), (int) size );
+      return;
+    }
+  }
+
+  atomic_increment( (volatile unsigned int *) &(stats.untracked_allocs) );
+}
+
+/** @brief counts a block handed out
+ *  @param size bytes requested
+ *  @param cls size class of the block, MALLOC_NUM_CLASSES if large
+ *  @param site return address into the caller of the wrapper
+ *  @return void
+ */
+static void stats_alloc(size_t size, unsigned int cls, unsigned int site)
+{
+  unsigned int live = atomic_fetch_add( (volatile int *) &(stats.live_bytes),
+                                        (int) size ) + size;
+  unsigned int peak = atomic_load( (volatile unsigned int *) &(stats.peak_bytes) );
+
+  while ( live > peak )
+  {
+    unsigned int old = atomic_compare_swap( (volatile unsigned int *) &(stats.peak_bytes),
+                                            peak, live );
+    if ( old == peak )
+    {
+      break;
+    }
+    peak = old;
+  }
+
+  atomic_increment( (volatile unsigned int *) &(stats.allocs) );
+  atomic_increment( (volatile unsigned int *) &(stats.class_allocs[cls]) );
+  stats_site( site, size );
+}
+
+/** @brief counts a block given back
+ *  @param size bytes requested for the block
+ *  @param cls size class of the block, MALLOC_NUM_CLASSES if large
+ *  @return void
+ */
+static void stats_free(size_t size, unsigned int cls)
+{
+  atomic_fetch_add( (volatile int *) &(stats.live_bytes), -(int) size );
+  atomic_increment( (volatile unsigned int *) &(stats.frees) );
+  atomic_increment( (volatile unsigned int *) &(stats.class_frees[cls]) );
+}
+
+/** counts a trip to the heap */
+#define STATS_TRIP(counter) atomic_increment( (volatile unsigned int *) &(stats.counter) )
+
+#else
+
+#define MALLOC_CALLER() 0
+#define stats_alloc(size, cls, site) ((void) (size), (void) (cls))
+#define stats_free(size, cls) ((void) (size), (void) (cls))
+#define STATS_TRIP(counter) ((void) 0)
+
+#endif /* MALLOC_STATS */
+
+/** @brief returns the header of a block
+ *  @param buf the block, as handed out
+ *  @return its header
+ */
+static inline malloc_header_t *block_header(void *buf)
+{
+  return ((malloc_header_t *) buf) - 1;
+}
+
+/** @brief takes heap_mutex, once multi-threading has begun
+ *  @return void
+ */
+static inline void heap_lock(void)
+{
+  if ( mutex_initialized )
+  {
+    mutex_lock( &heap_mutex );
+  }
+}
+
+/** @brief releases heap_mutex, once multi-threading has begun
+ *  @return void
+ */
+static inline void heap_unlock(void)
+{
+  if ( mutex_initialized )
+  {
+    mutex_unlock( &heap_mutex );
+  }
+}
+
+/** @brief finds the size class of a request
+ *  @param size the number of bytes requested
+ *  @return the smallest class that fits size, MALLOC_CLASS_LARGE if none
+ */
+static unsigned int size_class(size_t size)
+{
+  unsigned int cls = 0;
+
+  while ( cls < MALLOC_NUM_CLASSES && MALLOC_CLASS_SIZE(cls) < size )
+  {
+    cls++;
+  }
+  return ( cls == MALLOC_NUM_CLASSES ) ? MALLOC_CLASS_LARGE : cls;
+}
+
+/** @brief allocates a block from the heap
+ *  @param size the number of bytes of the block
+ *  @param info the header info of the block
+ *
+ *  requires heap_mutex is held
+ *
+ *  @return the block, NULL on failure
+ */
+static void *heap_alloc(size_t size, unsigned int info)
+{
+  if ( size > (size_t) -1 - sizeof(malloc_header_t) )
+  {
+    return NULL;
+  }
+
+  malloc_header_t *header = _malloc( sizeof(malloc_header_t) + size );
+  if ( header == NULL )
+  {
+    return NULL;
+  }
+
+  (header->size) = size;
+  (header->info) = info;
+  return header + 1;
+}
+
+/** @brief returns a block to the heap
+ *  @param buf the block
+ *
+ *  requires heap_mutex is held
+ *
+ *  @return void
+ */
+static void heap_free(void *buf)
+{
+  malloc_header_t *header = block_header( buf );
+
+  if ( (header->info) != MALLOC_CLASS_LARGE && ((header->info) & MALLOC_ALIGNED) )
+  {
+    _free( ((char *) buf) - ((header->info) & ~MALLOC_ALIGNED) );
+  }
+  else
+  {
+    _free( header );
+  }
+}
+
+/** @brief takes the first block off a free list
+ *  @param list the list, must not be empty
+ *  @return the block
+ */
+static inline void *list_pop(malloc_free_list_t *list)
+{
+  malloc_free_block_t *block = (list->head);
+  (list->head) = (block->next);
+  (list->count)--;
+  return block;
+}
+
+/** @brief puts a block at the front of a free list
+ *  @param list the list
+ *  @param buf the block
+ *  @return void
+ */
+static inline void list_push(malloc_free_list_t *list, void *buf)
+{
+  malloc_free_block_t *block = (malloc_free_block_t *) buf;
+  (block->next) = (list->head);
+  (list->head) = block;
+  (list->count)++;
+}
+
+/** @brief fills an empty cache list with a batch of blocks from the heap
+ *  @param list the list
+ *  @param cls the size class of the list
+ *  @param sized whether the list holds bare sized blocks
+ *  @return true if at least one block was fetched
+ */
+static bool cache_refill(malloc_free_list_t *list, unsigned int cls, bool sized)
+{
+  int i;
+
+  heap_lock();
+  for ( i = 0; i < MALLOC_BATCH; i++ )
+  {
+    void *block = sized ?
+                  _smemalign( MALLOC_CLASS_SIZE(cls), MALLOC_CLASS_SIZE(cls) ) :
+                  heap_alloc( MALLOC_CLASS_SIZE(cls), cls );
+    if ( block == NULL )
+    {
+      break;
+    }
+    list_push( list, block );
+  }
+  heap_unlock();
+  STATS_TRIP(refills);
+
+  return (list->count) > 0;
+}
+
+/** @brief gives blocks of a cache list back to the heap
+ *  @param list the list
+ *  @param cls the size class of the list
+ *  @param sized whether the list holds bare sized blocks
+ *  @param keep the number of blocks to leave in the list
+ *  @return void
+ */
+static void cache_flush(malloc_free_list_t *list, unsigned int cls, bool sized,
+                        unsigned int keep)
+{
+  heap_lock();
+  while ( (list->count) > keep )
+  {
+    void *block = list_pop( list );
+    if ( sized )
+    {
+      _sfree( block, MALLOC_CLASS_SIZE(cls) );
+    }
+    else
+    {
+      heap_free( block );
+    }
+  }
+  heap_unlock();
+  STATS_TRIP(flushes);
+}
+
+/** @brief thread-local destructor of a cache, run when its thread exits
+ *  @param arg the cache
+ *  @return void
+ */
+static void cache_destroy(void *arg)
+{
+  malloc_cache_t *cache = (malloc_cache_t *) arg;
+  unsigned int cls;
+
+  for ( cls = 0; cls < MALLOC_NUM_CLASSES; cls++ )
+  {
+    cache_flush( &(cache->headed[cls]), cls, false, 0 );
+    cache_flush( &(cache->sized[cls]), cls, true, 0 );
+  }
+
+  heap_lock();
+  _free( cache );
+  heap_unlock();
+}
+
+/** @brief finds the cache of the calling thread, creating it on first use
+ *  @return the cache, NULL if the caller must go to the heap directly
+ */
+static malloc_cache_t *current_cache(void)
+{
+  if ( !caches_enabled )
+  {
+    return NULL;
+  }
+
+  // fibers run off the thread stacks and have no metadata, they use the heap
+  thr_stack_meta_t *meta = find_current_thread_meta();
+  if ( meta == NULL )
+  {
+    return NULL;
+  }
+
+  malloc_cache_t *cache = (meta->tls[malloc_key]);
+  if ( cache == NULL )
+  {
+    heap_lock();
+    cache = _malloc( sizeof(malloc_cache_t) );
+    heap_unlock();
+
+    if ( cache != NULL )
+    {
+      memset( cache, 0, sizeof(malloc_cache_t) );
+      (meta->tls[malloc_key]) = cache;
+    }
+  }
+  return cache;
+}
+
+/** @brief the statistics bucket of a block
+ *  @param buf the block
+ *  @return its size class, MALLOC_NUM_CLASSES if it is not in one
+ */
+static inline unsigned int stats_class(void *buf)
+{
+  unsigned int info = (block_header( buf )->info);
+  return ( info < MALLOC_NUM_CLASSES ) ? info : MALLOC_NUM_CLASSES;
+}
 
 /** @brief initializes the relevant synchronization primitives for thread safe
  *         malloc/calloc/realloc/free
@@ -48,6 +447,89 @@ int malloc_init()
   }
 }
 
+/** @brief turns on the per-thread caches
+ *
+ *  needs thread-local storage keys, so thr_init calls it once the thread
+ *  table holds the root thread; until then every request goes to the heap
+ *
+ *  @returns 0 on success, negative integer on failure
+ */
+int malloc_cache_init()
+{
+  if ( caches_enabled )
+  {
+    return ERROR_DOUBLE_INITIALIZATION;
+  }
+
+  int ret = thr_key_create( &malloc_key, cache_destroy );
+  if ( ret == SUCCESS_RETURN )
+  {
+    caches_enabled = true;
+  }
+  return ret;
+}
+
+/** @brief hands out a block, from the thread's cache if it has a class
+ *  @param size the number of bytes requested
+ *  @return the block, NULL on failure
+ */
+static void *alloc_block(size_t size)
+{
+  unsigned int cls = size_class( size );
+  malloc_cache_t *cache = ( cls == MALLOC_CLASS_LARGE ) ? NULL : current_cache();
+  malloc_header_t *block;
+
+  if ( cache == NULL )
+  {
+    heap_lock();
+    block = ( cls == MALLOC_CLASS_LARGE ) ?
+            heap_alloc( size, cls ) :
+            heap_alloc( MALLOC_CLASS_SIZE(cls), cls );
+    heap_unlock();
+  }
+  else
+  {
+    malloc_free_list_t *list = &(cache->headed[cls]);
+    if ( (list->head) == NULL && !cache_refill( list, cls, false ) )
+    {
+      return NULL;
+    }
+    block = list_pop( list );
+  }
+
+  if ( block != NULL )
+  {
+    (block_header( block )->size) = size;
+  }
+  return block;
+}
+
+/** @brief takes back a block, into the thread's cache if it has a class
+ *  @param buf the block
+ *  @return void
+ */
+static void free_block(void *buf)
+{
+  unsigned int cls = (block_header( buf )->info);
+  malloc_cache_t *cache = ( cls < MALLOC_NUM_CLASSES ) ? current_cache() : NULL;
+
+  if ( cache == NULL )
+  {
+    heap_lock();
+    heap_free( buf );
+    heap_unlock();
+    return;
+  }
+
+  malloc_free_list_t *list = &(cache->headed[cls]);
+  list_push( list, buf );
+
+  if ( (list->count) > MALLOC_CACHE_MAX )
+  {
+    cache_flush( list, cls, false, MALLOC_CACHE_MAX / 2 );
+  }
+}
+
 /** @brief thread safe wrapper for malloc
  *  @param __size the number of bytes to request to be allocated
  *  @return a generic pointer to the newly allocated space on success,
@@ -55,40 +537,35 @@ int malloc_init()
  */
 void *malloc(size_t __size)
 {
-  if ( mutex_initialized )
-  {
-    mutex_lock( &heap_mutex );
-    void* mem_ptr = _malloc( __size );
-    mutex_unlock( &heap_mutex );
+  void* mem_ptr = alloc_block( __size );
 
-    return mem_ptr;
-  }
-  else
+  if ( mem_ptr != NULL )
   {
-    return _malloc( __size );
+    stats_alloc( __size, stats_class( mem_ptr ), MALLOC_CALLER() );
   }
+  return mem_ptr;
 }
 
 /** @brief thread safe wrapper for calloc
  *  @param __nelt number of "base units" to allocate
- *  @param __eltsize size of the base "unit" to allocate in
+ *  @param __eltsize size of the "base unit" to allocate in
  *  @returns a generic pointer to newly allocated space on success,
  *           NULL on failure
  */
 void *calloc(size_t __nelt, size_t __eltsize)
 {
-  if ( mutex_initialized )
+  if ( __eltsize != 0 && __nelt > (size_t) -1 / __eltsize )
   {
-    mutex_lock( &heap_mutex );
-    void* mem_ptr = _calloc( __nelt, __eltsize );
-    mutex_unlock( &heap_mutex );
-
-    return mem_ptr;
+    return NULL;
   }
-  else
+
+  void* mem_ptr = alloc_block( __nelt * __eltsize );
+  if ( mem_ptr != NULL )
   {
-    return _calloc( __nelt, __eltsize );
+    memset( mem_ptr, 0, __nelt * __eltsize );
+    stats_alloc( __nelt * __eltsize, stats_class( mem_ptr ), MALLOC_CALLER() );
   }
+  return mem_ptr;
 }
 
 /** @brief thread safe wrapper for realloc
@@ -99,18 +576,113 @@ void *calloc(size_t __nelt, size_t __eltsize)
  */
 void *realloc(void *__buf, size_t __new_size)
 {
-  if ( mutex_initialized )
+  if ( __buf == NULL )
   {
-    mutex_lock( &heap_mutex );
-    void* mem_ptr = _realloc( __buf, __new_size );
-    mutex_unlock( &heap_mutex );
-
+    void* mem_ptr = alloc_block( __new_size );
+    if ( mem_ptr != NULL )
+    {
+      stats_alloc( __new_size, stats_class( mem_ptr ), MALLOC_CALLER() );
+    }
     return mem_ptr;
   }
+
+  malloc_header_t *header = block_header( __buf );
+  unsigned int cls = size_class( __new_size );
+  size_t old_size = (header->size);
+  unsigned int old_class = stats_class( __buf );
+  void* mem_ptr;
+
+  if ( (header->info) < MALLOC_NUM_CLASSES && (header->info) == cls )
+  {
+    // a size class block already fits anything of its class
+    (header->size) = __new_size;
+    mem_ptr = __buf;
+  }
+  else if ( (header->info) == MALLOC_CLASS_LARGE && cls == MALLOC_CLASS_LARGE )
+  {
+    if ( __new_size > (size_t) -1 - sizeof(malloc_header_t) )
+    {
+      return NULL;
+    }
+
+    heap_lock();
+    malloc_header_t *new_header = _realloc( header, sizeof(malloc_header_t) + __new_size );
+    heap_unlock();
+
+    if ( new_header == NULL )
+    {
+      return NULL;
+    }
+    (new_header->size) = __new_size;
+    mem_ptr = new_header + 1;
+  }
+  else
+  {
+    mem_ptr = alloc_block( __new_size );
+    if ( mem_ptr == NULL )
+    {
+      return NULL;
+    }
+    memcpy( mem_ptr, __buf, ( old_size < __new_size ) ? old_size : __new_size );
+    free_block( __buf );
+  }
+
+  stats_free( old_size, old_class );
+  stats_alloc( __new_size, stats_class( mem_ptr ), MALLOC_CALLER() );
+  return mem_ptr;
+}
+
+/** @brief thread safe wrapper for memalign
+ *  @param __alignment the alignment of the block, a power of two
+ *  @param __size the number of bytes to request to be allocated
+ *
+ *  the block is placed __alignment bytes into an aligned heap block, which
+ *  leaves room for its header
+ *
+ *  @return a generic pointer to the newly allocated space on success,
+ *          NULL on failure
+ */
+void *memalign(size_t __alignment, size_t __size)
+{
+  if ( __alignment == 0 || (__alignment & (__alignment - 1)) != 0 ||
+       __alignment >= MALLOC_ALIGNED )
+  {
+    return NULL;
+  }
+
+  void* mem_ptr;
+
+  if ( __alignment <= sizeof(malloc_header_t) )
+  {
+    mem_ptr = alloc_block( __size );
+  }
   else
   {
-    return _realloc( __buf, __new_size );
+    if ( __size > (size_t) -1 - __alignment )
+    {
+      return NULL;
+    }
+
+    heap_lock();
+    char* raw_ptr = _memalign( __alignment, __alignment + __size );
+    heap_unlock();
+
+    if ( raw_ptr == NULL )
+    {
+      return NULL;
+    }
+
+    mem_ptr = raw_ptr + __alignment;
+    malloc_header_t *header = block_header( mem_ptr );
+    (header->size) = __size;
+    (header->info) = MALLOC_ALIGNED | __alignment;
+  }
+
+  if ( mem_ptr != NULL )
+  {
+    stats_alloc( __size, stats_class( mem_ptr ), MALLOC_CALLER() );
   }
+  return mem_ptr;
 }
 
 /** @brief thread safe wrapper for free
@@ -119,14 +691,220 @@ void *realloc(void *__buf, size_t __new_size)
  */
 void free(void *__buf)
 {
-  if ( mutex_initialized )
+  if ( __buf == NULL )
   {
-    mutex_lock( &heap_mutex );
-    _free( __buf );
-    mutex_unlock( &heap_mutex );
+    return;
+  }
+
+  stats_free( block_header( __buf )->size, stats_class( __buf ) );
+  free_block( __buf );
+}
+
+/** @brief hands out a bare block of a size class
+ *  @param cls the size class
+ *
+ *  bare class blocks are allocated aligned to their own size, so one
+ *  serves any alignment up to its size
+ *
+ *  @return the block, NULL on failure
+ */
+static void *alloc_sized_block(unsigned int cls)
+{
+  malloc_cache_t *cache = current_cache();
+
+  if ( cache == NULL )
+  {
+    heap_lock();
+    void* mem_ptr = _smemalign( MALLOC_CLASS_SIZE(cls), MALLOC_CLASS_SIZE(cls) );
+    heap_unlock();
+
+    return mem_ptr;
+  }
+
+  malloc_free_list_t *list = &(cache->sized[cls]);
+  if ( (list->head) == NULL && !cache_refill( list, cls, true ) )
+  {
+    return NULL;
+  }
+  return list_pop( list );
+}
+
+/** @brief thread safe wrapper for smalloc
+ *  @param __size the number of bytes to request to be allocated
+ *
+ *  the block has no header, it must be freed with sfree and the same size
+ *
+ *  @return a generic pointer to the newly allocated space on success,
+ *          NULL on failure
+ */
+void *smalloc(size_t __size)
+{
+  unsigned int cls = size_class( __size );
+  void* mem_ptr;
+
+  if ( cls == MALLOC_CLASS_LARGE )
+  {
+    heap_lock();
+    mem_ptr = _smalloc( __size );
+    heap_unlock();
+  }
+  else
+  {
+    mem_ptr = alloc_sized_block( cls );
+  }
+
+  if ( mem_ptr != NULL )
+  {
+    stats_alloc( __size, ( cls == MALLOC_CLASS_LARGE ) ? MALLOC_NUM_CLASSES : cls,
+                 MALLOC_CALLER() );
+  }
+  return mem_ptr;
+}
+
+/** @brief thread safe wrapper for smemalign
+ *  @param __alignment the alignment of the block, a power of two
+ *  @param __size the number of bytes to request to be allocated
+ *
+ *  the block has no header, it must be freed with sfree and the same size.
+ *  A small block aligned more strictly than its class is still allocated
+ *  with the full class size, so sfree can cache it like any other.
+ *
+ *  @return a generic pointer to the newly allocated space on success,
+ *          NULL on failure
+ */
+void *smemalign(size_t __alignment, size_t __size)
+{
+  if ( __alignment == 0 || (__alignment & (__alignment - 1)) != 0 )
+  {
+    return NULL;
+  }
+
+  unsigned int cls = size_class( __size );
+  void* mem_ptr;
+
+  if ( cls != MALLOC_CLASS_LARGE && __alignment <= MALLOC_CLASS_SIZE(cls) )
+  {
+    mem_ptr = alloc_sized_block( cls );
   }
   else
   {
-    _free( __buf );
+    heap_lock();
+    mem_ptr = _smemalign( __alignment, ( cls == MALLOC_CLASS_LARGE ) ?
+                                       __size : MALLOC_CLASS_SIZE(cls) );
+    heap_unlock();
+  }
+
+  if ( mem_ptr != NULL )
+  {
+    stats_alloc( __size, ( cls == MALLOC_CLASS_LARGE ) ? MALLOC_NUM_CLASSES : cls,
+                 MALLOC_CALLER() );
+  }
+  return mem_ptr;
+}
+
+/** @brief thread safe wrapper for sfree
+ *  @param __buf pointer to space from smalloc or smemalign to let go of
+ *  @param __size the size it was requested with
+ *
+ *  the size names the class of the block, so there is no header to read
+ *
+ *  @return void
+ */
+void sfree(void *__buf, size_t __size)
+{
+  if ( __buf == NULL )
+  {
+    return;
+  }
+
+  unsigned int cls = size_class( __size );
+  malloc_cache_t *cache = ( cls == MALLOC_CLASS_LARGE ) ? NULL : current_cache();
+
+  stats_free( __size, ( cls == MALLOC_CLASS_LARGE ) ? MALLOC_NUM_CLASSES : cls );
+
+  if ( cache == NULL )
+  {
+    heap_lock();
+    _sfree( __buf, ( cls == MALLOC_CLASS_LARGE ) ? __size : MALLOC_CLASS_SIZE(cls) );
+    heap_unlock();
+    return;
+  }
+
+  malloc_free_list_t *list = &(cache->sized[cls]);
+  list_push( list, __buf );
+
+  if ( (list->count) > MALLOC_CACHE_MAX )
+  {
+    cache_flush( list, cls, true, MALLOC_CACHE_MAX / 2 );
+  }
+}
+
+/** @brief takes a snapshot of the allocation statistics
+ *  @param stats where to store the snapshot
+ *
+ *  the counters keep moving while they are copied, so a snapshot taken
+ *  while other threads allocate is only approximately consistent
+ *
+ *  @return 0 on success, ERROR_NOT_SUPPORTED if the library was built
+ *          without MALLOC_STATS, negative number on other failures
+ */
+int malloc_stats_get(malloc_stats_t *__stats)
+{
+  if ( __stats == NULL )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+#ifdef MALLOC_STATS
+  memcpy( __stats, &stats, sizeof(malloc_stats_t) );
+  return SUCCESS_RETURN;
+#else
+  memset( __stats, 0, sizeof(malloc_stats_t) );
+  return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** @brief prints the allocation statistics to the simulator console
+ *  @return void
+ */
+void malloc_stats_dump(void)
+{
+  malloc_stats_t snapshot;
+
+  if ( malloc_stats_get( &snapshot ) < 0 )
+  {
+    lprintf("malloc stats: not built with MALLOC_STATS\n");
+    return;
+  }
+
+  lprintf("malloc stats: live %u bytes, peak %u bytes\n",
+          snapshot.live_bytes, snapshot.peak_bytes);
+  lprintf("malloc stats: %u allocs, %u frees, %u refills, %u flushes\n",
+          snapshot.allocs, snapshot.frees, snapshot.refills, snapshot.flushes);
+
+  int cls;
+  for ( cls = 0; cls <= MALLOC_NUM_CLASSES; cls++ )
+  {
+    if ( cls < MALLOC_NUM_CLASSES )
+    {
+      lprintf("  class %5u: %u allocs, %u frees\n", MALLOC_CLASS_SIZE(cls),
+              snapshot.class_allocs[cls], snapshot.class_frees[cls]);
+    }
+    else
+    {
+      lprintf("  large      : %u allocs, %u frees\n",
+              snapshot.class_allocs[cls], snapshot.class_frees[cls]);
+    }
+  }
+
+  int i;
+  for ( i = 0; i < MALLOC_STATS_SITES; i++ )
+  {
+    if ( snapshot.sites[i].site != 0 )
+    {
+      lprintf("  site 0x%08x: %u allocs, %u bytes\n", snapshot.sites[i].site,
+              snapshot.sites[i].allocs, snapshot.sites[i].bytes);
+    }
   }
+  lprintf("  untracked sites: %u allocs\n", snapshot.untracked_allocs);
 }
@@ -11,11 +11,210 @@
 #include <stdbool.h>
 #include <simics.h>
 #include <syscall.h>
+#include <malloc.h>
 #include <mutex.h>
+#include <sync_ext.h>
 #include <thread.h>
 #include <mutex_private.h>
+#include "thr_internals.h"
 #include "error_code.h"
 
+/** @brief acquires the spin lock protecting the morph queue of mp
+ *  @param mp the mutex
+ *  @return void
+ */
+static void morph_lock( mutex_t *mp )
+{
+  while ( atomic_compare_swap( &(mp->morph_lock), 0, 1 ) != 0 )
+  {
+    thr_yield(YIELD_ANYONE);
+  }
+}
+
+/** @brief releases the spin lock protecting the morph queue of mp
+ *  @param mp the mutex
+ *  @return void
+ */
+static void morph_unlock( mutex_t *mp )
+{
+  atomic_store( &(mp->morph_lock), 0 );
+}
+
+/** @brief serves the ticket whose turn it is
+ *  @param mp the mutex
+ *
+ *  passes the turn over every ticket given up by a timed out waiter, then
+ *  wakes the mutex_timedlock waiter holding the ticket served, if it
+ *  sleeps. The waiter is woken under the morph lock, which it takes
+ *  before it returns, so its metadata can't go away meanwhile.
+ *
+ *  requires caller owns the morph lock of mp
+ *
+ *  @return the skip records taken off, for the caller to free once it
+ *          drops the morph lock
+ */
+static mutex_skip_t *serve_turn( mutex_t *mp )
+{
+  mutex_skip_t *done = NULL;
+
+  while ( (mp->skipped) != NULL && (mp->skipped->ticket) == (mp->turn) )
+  {
+    mutex_skip_t *skip = (mp->skipped);
+    (mp->skipped) = (skip->next);
+    (skip->next) = done;
+    done = skip;
+    atomic_increment( &(mp->turn) );
+  }
+
+  thr_stack_meta_t* waiter;
+  Q_FOREACH( waiter, &(mp->ticket_queue), cv_link )
+  {
+    if ( (waiter->wait_ticket) == (mp->turn) )
+    {
+      Q_REMOVE( &(mp->ticket_queue), waiter, cv_link );
+      (waiter->wait_state) = WAITING_NONE;
+      wake_thread( waiter );
+      break;
+    }
+  }
+  return done;
+}
+
+/** @brief frees the skip records returned by serve_turn
+ *  @param done the records
+ *  @return void
+ */
+static void free_skips( mutex_skip_t *done )
+{
+  while ( done != NULL )
+  {
+    mutex_skip_t *next = (done->next);
+    free( done );
+    done = next;
+  }
+}
+
+/** @brief sleeps until the ticket of a mutex_timedlock waiter is served,
+ *         or until its deadline passes
+ *  @param mp the mutex
+ *  @param self metadata of the calling thread
+ *  @param ticket the ticket the caller drew
+ *  @param deadline get_ticks() value at which to give up
+ *  @return void, the caller checks turn and the deadline again
+ */
+static void wait_for_ticket( mutex_t *mp, thr_stack_meta_t* self,
+                             unsigned int ticket, unsigned int deadline )
+{
+  (self->wake_flag) = 0;
+  (self->wait_ticket) = ticket;
+
+  morph_lock( mp );
+  // cv_link may still point into a cond queue the thread was on, and
+  // serve_turn walks the queue to its end
+  Q_INIT_ELEM( self, cv_link );
+  Q_INSERT_TAIL( &(mp->ticket_queue), self, cv_link );
+  (self->wait_state) = WAITING_ON_TICKET;
+
+  // mutex_unlock bumps turn before it looks at the queue, so either it
+  // sees us queued or we see our turn here
+  memory_barrier();
+  bool served = ( (mp->turn) == ticket );
+  morph_unlock( mp );
+
+  if ( !served )
+  {
+    wait_for_wake_until( self, deadline );
+  }
+
+  morph_lock( mp );
+  if ( (self->wait_state) == WAITING_ON_TICKET )
+  {
+    Q_REMOVE( &(mp->ticket_queue), self, cv_link );
+    (self->wait_state) = WAITING_NONE;
+  }
+  morph_unlock( mp );
+}
+
+/** @brief gives up the ticket of a timed out mutex_timedlock waiter
+ *  @param mp the mutex
+ *  @param ticket the ticket the caller drew
+ *  @param skip the record to leave behind for the ticket
+ *  @return 0 if the ticket turned out to be served, so the caller holds
+ *          mp, ERROR_TIMED_OUT otherwise
+ */
+static int give_up_ticket( mutex_t *mp, unsigned int ticket,
+                           mutex_skip_t *skip )
+{
+  morph_lock( mp );
+  if ( (mp->turn) == ticket )
+  {
+    morph_unlock( mp );
+    free( skip );
+    return SUCCESS_RETURN;
+  }
+
+  // keep the skipped tickets in the order they will be served
+  mutex_skip_t **prev = &(mp->skipped);
+  while ( *prev != NULL && (int)((*prev)->ticket - ticket) < 0 )
+  {
+    prev = &((*prev)->next);
+  }
+  (skip->ticket) = ticket;
+  (skip->next) = *prev;
+  *prev = skip;
+
+  // an unlock may have served the ticket before it could see the record,
+  // then the mutex is left to us to pass on
+  memory_barrier();
+  mutex_skip_t *done = serve_turn( mp );
+  morph_unlock( mp );
+
+  free_skips( done );
+  return ERROR_TIMED_OUT;
+}
+
+/** @brief parks a condition variable waiter on the morph queue of mp
+ *  @param mp the mutex the waiter gave to cond_wait
+ *  @param meta metadata of the waiter, already off the cv queue
+ *
+ *  Instead of waking every waiter at once on cond_broadcast, only to
+ *  have them all pile up on mp, the waiters are moved here and
+ *  mutex_unlock wakes one of them each time mp is released.
+ *
+ *  @return void
+ */
+void mutex_requeue( mutex_t *mp, thr_stack_meta_t* meta )
+{
+  morph_lock( mp );
+  // the waiter was just taken off the cv queue, drop its old links
+  Q_INIT_ELEM( meta, cv_link );
+  Q_INSERT_TAIL( &(mp->morph_queue), meta, cv_link );
+  (meta->wait_state) = WAITING_ON_MUTEX;
+  morph_unlock( mp );
+}
+
+/** @brief takes a timed out waiter off the morph queue of mp
+ *  @param mp the mutex the waiter gave to cond_timedwait
+ *  @param meta metadata of the waiter
+ *  @return true if the waiter was still on the queue, false if an unlock
+ *          already took it off to wake it
+ */
+bool mutex_unqueue( mutex_t *mp, thr_stack_meta_t* meta )
+{
+  bool queued = false;
+
+  morph_lock( mp );
+  if ( (meta->wait_state) == WAITING_ON_MUTEX )
+  {
+    Q_REMOVE( &(mp->morph_queue), meta, cv_link );
+    (meta->wait_state) = WAITING_NONE;
+    queued = true;
+  }
+  morph_unlock( mp );
+
+  return queued;
+}
+
 /** @brief initializes mutex lock pointed to by mp
  *  @param mp the pointer to an uninitialized mutex to initialize
  *  @returns 0 on success, negative on failure
@@ -37,6 +236,10 @@ int mutex_init( mutex_t *mp )
   (mp->valid) = LOCK_INITIALIZED;
   (mp->ticket_num) = 0;
   (mp->turn) = 0;
+  (mp->morph_lock) = 0;
+  Q_INIT_HEAD( &(mp->morph_queue) );
+  Q_INIT_HEAD( &(mp->ticket_queue) );
+  (mp->skipped) = NULL;
 
   return SUCCESS_RETURN;
 }
@@ -54,7 +257,9 @@ void mutex_destroy( mutex_t *mp )
     return;
   }
 
-  if ( (mp->valid == LOCK_INITIALIZED) && ( mp->ticket_num != mp->turn) )
+  if ( (mp->valid == LOCK_INITIALIZED) &&
+       (( mp->ticket_num != mp->turn) || (mp->morph_queue.size) != 0 ||
+        (mp->ticket_queue.size) != 0 || (mp->skipped) != NULL) )
   {
     printf("mutex_destroy: try to destroy on mutex that is used.\n");
     return;
@@ -97,6 +302,89 @@ void mutex_lock( mutex_t *mp )
   }
 }
 
+/** @brief aquires the mutex pointed to by mp if it is free
+ *  @param mp pointer to the initialized mutex lock to aquire
+ *
+ *  a ticket can't be given back once drawn, so a ticket is only drawn
+ *  when it is the one being served
+ *
+ *  @return 0 on success, ERROR_WOULD_BLOCK if the mutex is held
+ */
+int mutex_trylock( mutex_t *mp )
+{
+  if ( mp == NULL )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  if ( (mp->valid == LOCK_UNINITIALIZED) )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  unsigned int turn = (mp->turn);
+  if ( atomic_compare_swap( &(mp->ticket_num), turn, turn + 1 ) != turn )
+  {
+    return ERROR_WOULD_BLOCK;
+  }
+  return SUCCESS_RETURN;
+}
+
+/** @brief aquires the mutex pointed to by mp, giving up at a deadline
+ *  @param mp pointer to the initialized mutex lock to aquire
+ *  @param deadline get_ticks() value at which to give up
+ *
+ *  draws a ticket like mutex_lock, so it is served in order with the
+ *  other waiters, and sleeps on the timed wait list until the ticket is
+ *  served. A waiter that times out leaves a skip record behind, and the
+ *  mutex passes over its ticket. The record is allocated before the
+ *  ticket is drawn, so giving the ticket up can't fail.
+ *
+ *  @return 0 on success, ERROR_TIMED_OUT if the deadline passed first,
+ *          negative number on other failures
+ */
+int mutex_timedlock( mutex_t *mp, unsigned int deadline )
+{
+  int ret = mutex_trylock( mp );
+  if ( ret != ERROR_WOULD_BLOCK )
+  {
+    return ret;
+  }
+
+  if ( deadline_passed( deadline ) )
+  {
+    return ERROR_TIMED_OUT;
+  }
+
+  mutex_skip_t *skip = malloc( sizeof(mutex_skip_t) );
+  if ( skip == NULL )
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+
+  thr_stack_meta_t* self = find_current_thread_meta();
+  unsigned int myticket = atomic_increment( &(mp->ticket_num) );
+
+  while ( myticket != (mp->turn) )
+  {
+    if ( deadline_passed( deadline ) )
+    {
+      return give_up_ticket( mp, myticket, skip );
+    }
+
+    // fibers have no metadata to sleep on, they poll like mutex_lock
+    if ( self == NULL )
+    {
+      thr_yield(YIELD_ANYONE);
+      continue;
+    }
+    wait_for_ticket( mp, self, myticket, deadline );
+  }
+
+  free( skip );
+  return SUCCESS_RETURN;
+}
+
 /** @brief releases the mutex pointed to by mp
  *  @param mp pointer to the mutex lock to release
  *
@@ -119,4 +407,33 @@ void mutex_unlock( mutex_t *mp )
   }
 
   atomic_increment( &(mp->turn) );
+
+  // the ticket served may have been given up, or its holder may sleep in
+  // mutex_timedlock
+  if ( (mp->skipped) != NULL || (mp->ticket_queue.size) > 0 )
+  {
+    morph_lock( mp );
+    mutex_skip_t *done = serve_turn( mp );
+    morph_unlock( mp );
+    free_skips( done );
+  }
+
+  // hand the mutex over to one waiter moved here by cond_broadcast, it
+  // wakes the next one when it unlocks in turn
+  if ( (mp->morph_queue.size) > 0 )
+  {
+    morph_lock( mp );
+    thr_stack_meta_t* next_thread = Q_GET_FRONT( &(mp->morph_queue) );
+    if ( next_thread != NULL )
+    {
+      Q_REMOVE( &(mp->morph_queue), next_thread, cv_link );
+      (next_thread->wait_state) = WAITING_NONE;
+    }
+    morph_unlock( mp );
+
+    if ( next_thread != NULL )
+    {
+      wake_thread( next_thread );
+    }
+  }
 }
@@ -6,10 +6,13 @@
  * @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
  */
 
-/***** ASM FUNCTION REFERENCES *****/
-/** @brief a function that increments pointer atomically
- *  @param ticket_num pointer to integer to increment atomically
- *  @return previous value of integer in the pointer
- */
-unsigned int atomic_increment(unsigned int* ticket_num);
+/***** ATOMIC OPERATIONS *****/
+#include <atomic.h>
 
+/** a ticket given up by a timed out mutex_timedlock, the mutex passes
+ *  straight over it when its turn comes
+ */
+typedef struct mutex_skip {
+  struct mutex_skip *next;  ///< next skipped ticket, in ticket order
+  unsigned int ticket;      ///< the ticket given up
+} mutex_skip_t;
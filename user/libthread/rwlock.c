@@ -1,6 +1,14 @@
 /** @file rwlock.c
  *  @brief implementation of reader/writer lock functions
  *
+ *  The lock is a single state word holding a writer bit, a waiting bit
+ *  and the count of readers. As long as nobody waits, readers come and go
+ *  with one atomic instruction on the word, and so do writers. A thread
+ *  that can't have the lock takes data_mutex, sets the waiting bit, which
+ *  closes the fast paths so writers aren't starved, and queues itself on
+ *  waiting_rw. The thread that releases the lock last then hands it to
+ *  the front of the queue in grant_waiters.
+ *
  *  @author Carlos Montemayor   (andrewid: cmontema, email: carl6256@gmail.com)
  */
 
@@ -13,6 +21,8 @@
 #include <thr_internals.h>
 #include <rwlock.h>
 #include <rwlock_internals.h>
+#include <sync_ext.h>
+#include "mutex_private.h"
 
 /** @brief initializes a new or destroyed reader-writer lock
  *  @param rwlock pointer to the reader-writer lock to initialize
@@ -22,6 +32,21 @@
  *  @return 0 on success, -1 on failure
  */
 int rwlock_init( rwlock_t* rwlock )
+{
+  return rwlock_init_ex( rwlock, RWLOCK_POLICY_FIFO );
+}
+
+/** @brief initializes a new or destroyed reader-writer lock with a
+ *         fairness policy
+ *  @param rwlock pointer to the reader-writer lock to initialize
+ *  @param policy one of RWLOCK_POLICY_FIFO, RWLOCK_POLICY_READER,
+ *         RWLOCK_POLICY_WRITER or RWLOCK_POLICY_PHASE_FAIR
+ *
+ *  requires that rwlock is not already initialized and it not null
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int rwlock_init_ex( rwlock_t* rwlock, int policy )
 {
   if ( rwlock == NULL )
   {
@@ -35,16 +60,30 @@ int rwlock_init( rwlock_t* rwlock )
     return ERROR_DOUBLE_INITIALIZATION;
   }
 
+  if ( policy < RWLOCK_POLICY_FIFO || policy > RWLOCK_POLICY_PHASE_FAIR )
+  {
+    printf("rwlock_init: invalid policy parameter\n");
+    return ERROR_INVALID_ARGUMENT;
+  }
+
   if ( mutex_init( &(rwlock->data_mutex) ) < 0 )
   {
     printf("rwlock_init: trying to init an initialized lock!\n");
     return ERROR_DOUBLE_INITIALIZATION;
   }
 
-  (rwlock->valid) = true;
-  (rwlock->reader_count) = 0;
   (rwlock->waiting_rw) = (rw_queue_t*) malloc( sizeof(rw_queue_t) );
-  (rwlock->mode) = RW_UNLOCKED;
+  if ( (rwlock->waiting_rw) == NULL )
+  {
+    mutex_destroy( &(rwlock->data_mutex) );
+    return ERROR_MALLOC_FAILED;
+  }
+
+  (rwlock->valid) = true;
+  (rwlock->state) = 0;
+  (rwlock->policy) = policy;
+  (rwlock->writers_waiting) = 0;
+  (rwlock->upgrader) = NULL;
 
   Q_INIT_HEAD( rwlock->waiting_rw );
 
@@ -75,14 +114,8 @@ void rwlock_destroy( rwlock_t* rwlock )
 
   mutex_lock( &(rwlock->data_mutex) );
 
-  if ( (rwlock->mode) != RW_UNLOCKED )
-  {
-    mutex_unlock( &(rwlock->data_mutex) );
-    printf("rwlock_destroy: trying to destroy a busy lock!\n");
-    return;
-  }
-
-  if ( (rwlock->waiting_rw)->size > 0 )
+  if ( (rwlock->state) != 0 || (rwlock->waiting_rw)->size > 0 ||
+       (rwlock->upgrader) != NULL )
   {
     mutex_unlock( &(rwlock->data_mutex) );
     printf("rwlock_destroy: trying to destroy a busy lock!\n");
@@ -91,14 +124,69 @@ void rwlock_destroy( rwlock_t* rwlock )
 
   // set rwlock struct to destoyed values
   (rwlock->valid) = false;
-  (rwlock->reader_count) = -1;
   free( rwlock->waiting_rw );
+  (rwlock->waiting_rw) = NULL;
 
   mutex_unlock( &(rwlock->data_mutex) );
 
   mutex_destroy( &(rwlock->data_mutex) );
 }
 
+/** @brief checks whether the policy lets a new arrival pass the waiting
+ *         threads
+ *  @param rwlock pointer to the reader-writer lock
+ *  @param type the mode to aquire the lock in
+ *
+ *  requires caller owns the rwlock's data_mutex
+ *
+ *  @return true if the thread may take the lock without queueing
+ */
+static bool rw_may_enter( rwlock_t* rwlock, int type )
+{
+  if ( RWLOCK_WRITE == type || RWLOCK_POLICY_FIFO == (rwlock->policy) )
+  {
+    return (rwlock->waiting_rw)->size == 0 && (rwlock->upgrader) == NULL;
+  }
+
+  // readers wait only for the writers, and not even those if preferred
+  return RWLOCK_POLICY_READER == (rwlock->policy) ||
+         (rwlock->writers_waiting) == 0;
+}
+
+/** @brief aquires a reader-writer lock under contention
+ *  @param rwlock pointer to the reader-writer lock to aquire
+ *  @param type the mode to aquire the lock in
+ *  @return void
+ */
+static void rwlock_lock_slow( rwlock_t* rwlock, int type )
+{
+  mutex_lock( &(rwlock->data_mutex) );
+
+  // close the fast paths first, so a holder leaving after our check sees
+  // somebody may be waiting
+  bool was_waiting = ((rwlock->state) & RW_STATE_WAITING);
+  if ( !was_waiting )
+  {
+    atomic_fetch_add( (volatile int *)&(rwlock->state), RW_STATE_WAITING );
+  }
+
+  if ( rw_may_enter( rwlock, type ) && rw_take( rwlock, type ) )
+  {
+    if ( !was_waiting )
+    {
+      atomic_fetch_add( (volatile int *)&(rwlock->state), -RW_STATE_WAITING );
+    }
+    mutex_unlock( &(rwlock->data_mutex) );
+    return;
+  }
+
+  thr_stack_meta_t* self = append_rw( rwlock, type );
+  mutex_unlock( &(rwlock->data_mutex) );
+
+  // grant_waiters takes the lock for us before waking us up
+  wait_for_grant( self );
+}
+
 /** @brief aquires a reader-writer lock
  *  @param rwlock pointer to the reader-writer lock to aquires
  *  @param type the mode to aquire the lock in, can be reading or writing
@@ -127,76 +215,34 @@ void rwlock_lock( rwlock_t* rwlock, int type )
     return;
   }
 
-  mutex_lock( &(rwlock->data_mutex) );
-
   if ( RWLOCK_READ == type )
   {
-    // if the lock is aquired, this changes the state to READING immediately,
-    // if the lock cannot be aquired and this is blocked, the state will be
-    // modified to READING after this thread has been made runnable again
-    int next_state = RW_READING;
-
-    switch ( (rwlock->mode) )
+    // retry only while other readers race us, anything else is contention,
+    // except that preferred readers don't care about waiting writers
+    unsigned int closed = RW_STATE_WRITER;
+    if ( RWLOCK_POLICY_READER != (rwlock->policy) )
     {
-      case RW_UNLOCKED:
-        (rwlock->reader_count) += 1;
-        break;
-      case RW_READING:
-
-        if ( (rwlock->waiting_rw)->size == 0 )
-        {
-          (rwlock->reader_count) += 1;
-          break;
-        }
-      case RW_WRITING:;
-
-        append_rw( rwlock, type);
-
-        mutex_unlock( &(rwlock->data_mutex) );
-
-        int reject_val = 0;
-        deschedule( &reject_val );
-
-        mutex_lock(  &(rwlock->data_mutex) );
-        (rwlock->reader_count) += 1;
-        break;
-      default:
-        break;
+      closed |= RW_STATE_WAITING;
     }
 
-    (rwlock->mode) = next_state;
-  }
-  else if ( RWLOCK_WRITE == type)
-  {
-    // if the lock is aquired, this changes the state to WRITING immediately,
-    // if the lock cannot be aquired and this is blocked, the state will be
-    // modified to WRITING after this thread has been made runnable again
-    int next_state = RW_WRITING;
-
-    switch ( (rwlock->mode) )
+    unsigned int state = atomic_load( &(rwlock->state) );
+    while ( !(state & closed) )
     {
-      case RW_UNLOCKED:
-        break;
-      case RW_READING:
-      case RW_WRITING:;
-
-        append_rw( rwlock, type);
-
-        mutex_unlock( &(rwlock->data_mutex) );
-
-        int reject_val = 0;
-        deschedule( &reject_val );
-
-        mutex_lock(  &(rwlock->data_mutex) );
-        break;
-      default:
-        break;
+      unsigned int old = atomic_compare_swap( &(rwlock->state), state,
+                                              state + RW_STATE_READER );
+      if ( old == state )
+      {
+        return;
+      }
+      state = old;
     }
-
-    (rwlock->mode) = next_state;
+  }
+  else if ( atomic_compare_swap( &(rwlock->state), 0, RW_STATE_WRITER ) == 0 )
+  {
+    return;
   }
 
-  mutex_unlock( &(rwlock->data_mutex) );
+  rwlock_lock_slow( rwlock, type );
 }
 
 /** @brief releases a reader-writer lock
@@ -221,41 +267,48 @@ void rwlock_unlock( rwlock_t* rwlock )
     return;
   }
 
-  mutex_lock( &(rwlock->data_mutex) );
+  // threads the lock gets handed to, woken after data_mutex is released
+  rw_queue_t granted;
+  Q_INIT_HEAD( &granted );
 
   // here we assume the unlocking application is responsible
   // and is one of the people holding the lock
-  int next_state = RW_UNLOCKED;
+  unsigned int state = atomic_load( &(rwlock->state) );
 
-  switch ( (rwlock->mode) )
+  if ( state & RW_STATE_WRITER )
   {
+    if ( atomic_compare_swap( &(rwlock->state), RW_STATE_WRITER, 0 )
+         == RW_STATE_WRITER )
+    {
+      return;
+    }
 
-    case RW_UNLOCKED:
-      // signal error
-      // should not be unlocking an unlocked rwlock
-      break;
-    case RW_READING:
-      if ( (rwlock->reader_count) > 1 )
-      {
-        (rwlock->reader_count) -= 1;
-      }
-      else
-      {
-        (rwlock->reader_count) -= 1;
-
-        next_state = dequeue( rwlock );
-      }
-      break;
-    case RW_WRITING:
-      next_state = dequeue( rwlock );
-      break;
-    default:
-      break;
+    // somebody is waiting, hand the lock over
+    mutex_lock( &(rwlock->data_mutex) );
+    atomic_fetch_add( (volatile int *)&(rwlock->state), -RW_STATE_WRITER );
+    grant_waiters( rwlock, true, &granted );
+    mutex_unlock( &(rwlock->data_mutex) );
+    wake_granted( &granted );
   }
+  else if ( RW_STATE_READERS(state) > 0 )
+  {
+    state = atomic_fetch_add( (volatile int *)&(rwlock->state),
+                              -RW_STATE_READER );
 
-  (rwlock->mode) = next_state;
-
-  mutex_unlock( &(rwlock->data_mutex) );
+    // the last reader out hands the lock to whoever waits, and so does
+    // the second to last, which may leave an upgrader alone
+    if ( (state & RW_STATE_WAITING) && RW_STATE_READERS(state) <= 2 )
+    {
+      mutex_lock( &(rwlock->data_mutex) );
+      grant_waiters( rwlock, false, &granted );
+      mutex_unlock( &(rwlock->data_mutex) );
+      wake_granted( &granted );
+    }
+  }
+  else
+  {
+    printf("rwlock_unlock: trying to unlock an unlocked lock!\n");
+  }
 }
 
 /** @brief converts a writer with the lock into a reader with the lock
@@ -279,22 +332,89 @@ void rwlock_downgrade( rwlock_t* rwlock )
     return;
   }
 
+  if ( !((rwlock->state) & RW_STATE_WRITER) )
+  {
+    return;
+  }
+
+  rw_queue_t granted;
+  Q_INIT_HEAD( &granted );
+
+  mutex_lock( &(rwlock->data_mutex) );
+
+  // trade the writer bit for a reader, then let the readers queued
+  // at the front in with us
+  atomic_fetch_add( (volatile int *)&(rwlock->state),
+                    RW_STATE_READER - RW_STATE_WRITER );
+  grant_waiters( rwlock, true, &granted );
+
+  mutex_unlock( &(rwlock->data_mutex) );
+  wake_granted( &granted );
+}
+
+/** @brief converts a reader with the lock into a writer with the lock,
+ *         without letting any other writer in between
+ *  @param rwlock pointer to a reader-writer lock to convert from
+ *         reading mode to writing mode
+ *
+ *  blocks until the other readers have left. Two readers upgrading at
+ *  once would wait for each other forever, so only one upgrade may be
+ *  pending: the second one fails and keeps its read hold.
+ *
+ *  requires that the current thread holds rwlock in reading mode, and the
+ *           lock is initialized and not NULL
+ *  @return 0 on success, negative number on failure
+ */
+int rwlock_upgrade( rwlock_t* rwlock )
+{
+  if ( rwlock == NULL )
+  {
+    printf("rwlock_upgrade: trying to upgrade on a NULL lock!\n");
+    return ERROR_NULL_POINTER;
+  }
+
+  if ( !(rwlock->valid) )
+  {
+    printf("rwlock_upgrade: trying to upgrade on an uninitialized lock!\n");
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  if ( RW_STATE_READERS(rwlock->state) == 0 )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
   mutex_lock( &(rwlock->data_mutex) );
 
-  if ( (rwlock->mode) == RW_WRITING )
+  if ( (rwlock->upgrader) != NULL )
   {
-    (rwlock->reader_count) += 1;
+    mutex_unlock( &(rwlock->data_mutex) );
+    return ERROR_UPGRADE_CONFLICT;
+  }
 
-    if ( (rwlock->waiting_rw)->size > 0 )
-    {
-      if ( RWLOCK_READ == (Q_GET_FRONT(rwlock->waiting_rw)->rw_type) )
-      {
-        dequeue( rwlock );
-      }
-    }
+  thr_stack_meta_t* self = find_current_thread_meta();
+  if ( self == NULL )
+  {
+    panic("rwlock_upgrade: can't find its stack meta data.\n");
+  }
+
+  rw_queue_t granted;
+  Q_INIT_HEAD( &granted );
 
-    (rwlock->mode) = RW_READING;
+  // queue as the upgrader, with the fast paths closed, and let
+  // grant_waiters convert our hold once we are the only reader
+  (self->wake_flag) = 0;
+  (rwlock->upgrader) = self;
+  (rwlock->writers_waiting) += 1;
+  if ( !((rwlock->state) & RW_STATE_WAITING) )
+  {
+    atomic_fetch_add( (volatile int *)&(rwlock->state), RW_STATE_WAITING );
   }
+  grant_waiters( rwlock, false, &granted );
 
   mutex_unlock( &(rwlock->data_mutex) );
+  wake_granted( &granted );
+
+  wait_for_grant( self );
+  return SUCCESS_RETURN;
 }
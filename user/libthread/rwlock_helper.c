@@ -6,100 +6,279 @@
  */
 
 #include <stddef.h>
-#include <malloc.h>
+#include <stdbool.h>
 #include <syscall.h>
 #include <thread.h>
 #include <rwlock.h>
 #include <rwlock_internals.h>
+#include "mutex_private.h"
 
-/** @brief appends a rwlock request to the end of the rwlock's waiting queue
+/** @brief appends the calling thread to the end of the rwlock's waiting
+ *         queue
  *  @param  rwlock pointer to lock to append to
  *  @param  type the mode to try to aquire the lock in
  *
  *  requires caller owns the rwlock's data_mutex
  *
- *  @return 0 on success, -1 on error
+ *  @return metadata of the calling thread
  */
-int append_rw( rwlock_t *rwlock, int type )
+thr_stack_meta_t* append_rw( rwlock_t *rwlock, int type )
 {
-  if ( rwlock == NULL )
-  {
-    return -1;
-  }
+  thr_stack_meta_t* new_element = find_current_thread_meta();
 
-  if ( !(rwlock->valid) )
+  if ( new_element == NULL )
   {
-    return -1;
+    panic("rwlock_lock: can't find its stack meta data.\n");
   }
 
-  thr_stack_meta_t* new_element = find_current_thread_meta();
   new_element->rw_type = type;
+  new_element->wake_flag = 0;
+  if ( RWLOCK_WRITE == type )
+  {
+    (rwlock->writers_waiting) += 1;
+  }
   rw_queue_t* header = (rwlock->waiting_rw);
 
+  // inserting into an empty queue leaves the links alone, and a walk of
+  // the queue must not follow one left from an earlier queue
+  Q_INIT_ELEM( new_element, rw_link );
   Q_INSERT_TAIL( header, new_element, rw_link );
 
-  return 0;
+  return new_element;
+}
+
+/** @brief takes the lock in the state word if no holder conflicts
+ *  @param rwlock pointer to the lock
+ *  @param type the mode to aquire the lock in
+ *
+ *  compare and swap, since with reader preference readers can still
+ *  enter on the fast path while threads wait
+ *
+ *  @return true if the lock was taken
+ */
+bool rw_take( rwlock_t* rwlock, int type )
+{
+  unsigned int state = atomic_load( &(rwlock->state) );
+
+  while ( !(state & RW_STATE_WRITER) &&
+          ( RWLOCK_READ == type || RW_STATE_READERS(state) == 0 ) )
+  {
+    unsigned int next = state + (( RWLOCK_READ == type ) ? RW_STATE_READER
+                                                         : RW_STATE_WRITER);
+    unsigned int old = atomic_compare_swap( &(rwlock->state), state, next );
+    if ( old == state )
+    {
+      return true;
+    }
+    state = old;
+  }
+  return false;
+}
+
+/** @brief moves a thread off the waiting queue onto the list of threads
+ *         to wake, the lock must already be taken for it
+ *  @param rwlock pointer to the lock
+ *  @param waiting the thread to wake
+ *  @param granted list of threads to wake once data_mutex is released
+ *  @return void
+ */
+static void release_waiter( rwlock_t* rwlock, thr_stack_meta_t* waiting,
+                            rw_queue_t* granted )
+{
+  Q_REMOVE( rwlock->waiting_rw, waiting, rw_link );
+  if ( RWLOCK_WRITE == (waiting->rw_type) )
+  {
+    (rwlock->writers_waiting) -= 1;
+  }
+  waiting->rw_type = RWLOCK_INVALID;
+  // Q_REMOVE leaves the old links, and the last thread on granted must
+  // not wake one still queued
+  Q_INIT_ELEM( waiting, rw_link );
+  Q_INSERT_TAIL( granted, waiting, rw_link );
+}
+
+/** @brief grants the lock to queued readers
+ *  @param rwlock pointer to the lock
+ *  @param prefix_only stop at the first queued writer instead of
+ *         letting every queued reader pass it
+ *  @param granted list of threads to wake once data_mutex is released
+ *
+ *  the readers are taken off the queue first and then let in with a
+ *  single add to the state word, which can't fail: no writer holds the
+ *  lock and, with the waiting bit set, none can take it without data_mutex
+ *
+ *  @return number of readers granted the lock
+ */
+static int grant_readers( rwlock_t* rwlock, bool prefix_only,
+                          rw_queue_t* granted )
+{
+  int count = 0;
+  thr_stack_meta_t* next_waiting = Q_GET_FRONT( rwlock->waiting_rw );
+
+  while ( next_waiting != NULL )
+  {
+    thr_stack_meta_t* next = Q_GET_NEXT( next_waiting, rw_link );
+
+    if ( RWLOCK_READ == (next_waiting->rw_type) )
+    {
+      release_waiter( rwlock, next_waiting, granted );
+      count++;
+    }
+    else if ( prefix_only )
+    {
+      break;
+    }
+    next_waiting = next;
+  }
+
+  if ( count > 0 )
+  {
+    atomic_fetch_add( (volatile int *)&(rwlock->state),
+                      count * RW_STATE_READER );
+  }
+  return count;
+}
+
+/** @brief grants the lock to the first queued writer, if no one holds it
+ *  @param rwlock pointer to the lock
+ *  @param granted list of threads to wake once data_mutex is released
+ *  @return void
+ */
+static void grant_writer( rwlock_t* rwlock, rw_queue_t* granted )
+{
+  thr_stack_meta_t* next_waiting = Q_GET_FRONT( rwlock->waiting_rw );
+
+  while ( next_waiting != NULL && RWLOCK_WRITE != (next_waiting->rw_type) )
+  {
+    next_waiting = Q_GET_NEXT( next_waiting, rw_link );
+  }
+
+  if ( next_waiting != NULL && rw_take( rwlock, RWLOCK_WRITE ) )
+  {
+    release_waiter( rwlock, next_waiting, granted );
+  }
 }
 
-/** @brief removes and wakes up appropriate threads off waiting queue
+/** @brief hands the lock to the waiting threads that can have it now
  *  @param rwlock pointer to the lock to dequeue waiting threads from
+ *  @param writer_left whether a writer just gave up the lock, as opposed
+ *         to the last reader
+ *  @param granted list the threads granted the lock are moved to, the
+ *         caller wakes them with wake_granted after releasing data_mutex
+ *
+ *  A pending upgrade goes first, as soon as the upgrader is the only
+ *  reader left. Otherwise the policy picks between the queued writers and
+ *  readers:
+ *    - FIFO grants the writer or the prefix of readers at the front
+ *    - reader preference grants every queued reader, writers only when
+ *      no reader waits
+ *    - writer preference grants a queued writer whenever there is one
+ *    - phase fair grants every queued reader after a writer, and a writer
+ *      after the readers
+ *  The lock is taken for the threads in the state word before they are
+ *  woken, so they own it when they wake up. The waiting bit is cleared
+ *  once nobody waits, reopening the fast paths.
  *
  *  requires rwlock != NULL
  *         && rwlock->valid
  *         && caller owns the rwlock's data_mutex
  *
- *  @returns next rwlock state
+ *  @returns void
  */
-int dequeue( rwlock_t* rwlock )
+void grant_waiters( rwlock_t* rwlock, bool writer_left, rw_queue_t* granted )
 {
-  thr_stack_meta_t* next_waiting = Q_GET_FRONT( rwlock->waiting_rw );
+  thr_stack_meta_t* upgrader = (rwlock->upgrader);
 
-  if ( next_waiting == NULL )
-  {
-    return RW_UNLOCKED;
-  } else
+  if ( upgrader != NULL )
   {
-    int type = (next_waiting->rw_type);
-
-    if ( RWLOCK_READ == type )
+    // trade the upgrader's read hold for the write hold, once it is alone
+    unsigned int state = atomic_load( &(rwlock->state) );
+    while ( RW_STATE_READERS(state) == 1 && !(state & RW_STATE_WRITER) )
     {
-      // dequeue all reads are part of the reader request prefix of the list
-      while ( RWLOCK_READ == type )
+      unsigned int old = atomic_compare_swap( &(rwlock->state), state,
+                           state - RW_STATE_READER + RW_STATE_WRITER );
+      if ( old == state )
       {
-        thr_stack_meta_t* next  = Q_GET_NEXT( next_waiting, rw_link );
-        Q_REMOVE( rwlock->waiting_rw, next_waiting, rw_link );
-        next_waiting->rw_type = RWLOCK_INVALID;
-
-        while ( make_runnable( next_waiting->tid ) < 0 )
-        {
-          thr_yield( next_waiting->tid );
-        }
-
-        if ( next == NULL )
-        {
-          break;
-        }
-
-        // prepare for next iteration
-        next_waiting = next;
-        type = (next_waiting->rw_type);
+        (rwlock->upgrader) = NULL;
+        (rwlock->writers_waiting) -= 1;
+        Q_INIT_ELEM( upgrader, rw_link );
+        Q_INSERT_TAIL( granted, upgrader, rw_link );
+        break;
       }
+      state = old;
+    }
+  }
+  else if ( !((rwlock->state) & RW_STATE_WRITER) )
+  {
+    bool writer_first = false;
+    bool prefix_only = false;
+    thr_stack_meta_t* front = Q_GET_FRONT( rwlock->waiting_rw );
 
-      return RW_READING;
+    switch ( (rwlock->policy) )
+    {
+      case RWLOCK_POLICY_READER:
+        break;
+      case RWLOCK_POLICY_WRITER:
+        writer_first = ( (rwlock->writers_waiting) > 0 );
+        break;
+      case RWLOCK_POLICY_PHASE_FAIR:
+        writer_first = !writer_left && ( (rwlock->writers_waiting) > 0 );
+        break;
+      default:
+        writer_first = ( front != NULL && RWLOCK_WRITE == (front->rw_type) );
+        prefix_only = true;
+        break;
     }
-    else if (RWLOCK_WRITE == type )
+
+    if ( writer_first || grant_readers( rwlock, prefix_only, granted ) == 0 )
     {
-      // dequeue only the next writer
-      Q_REMOVE( rwlock->waiting_rw, next_waiting, rw_link );
+      grant_writer( rwlock, granted );
+    }
+  }
 
-      while ( make_runnable( next_waiting->tid )  < 0 )
-      {
-        thr_yield( next_waiting->tid );
-      }
+  if ( (rwlock->waiting_rw)->size == 0 && (rwlock->upgrader) == NULL &&
+       ((rwlock->state) & RW_STATE_WAITING) )
+  {
+    atomic_fetch_add( (volatile int *)&(rwlock->state), -RW_STATE_WAITING );
+  }
+}
 
-      return RW_WRITING;
-    }
+/** @brief wakes the threads granted the lock by grant_waiters
+ *  @param granted the list filled in by grant_waiters
+ *
+ *  Only the first thread is woken here. The list stays linked through
+ *  rw_link, and every thread woken off it wakes the next one in
+ *  wait_for_grant, so a whole batch of readers is released without the
+ *  releasing thread making a system call per reader.
+ *
+ *  requires caller doesn't own the rwlock's data_mutex
+ *
+ *  @return void
+ */
+void wake_granted( rw_queue_t* granted )
+{
+  thr_stack_meta_t* first = Q_GET_FRONT( granted );
+
+  if ( first != NULL )
+  {
+    wake_thread( first );
   }
+}
 
-  return RW_UNLOCKED;
+/** @brief sleeps until grant_waiters granted the lock to the current
+ *         thread, then wakes the next thread granted along with it
+ *  @param self metadata of the current thread
+ *  @return void
+ */
+void wait_for_grant( thr_stack_meta_t* self )
+{
+  wait_for_wake( self );
+
+  // nobody touches our link until we queue again, and the next thread
+  // can't leave before we wake it
+  thr_stack_meta_t* next = Q_GET_NEXT( self, rw_link );
+  if ( next != NULL )
+  {
+    wake_thread( next );
+  }
 }
@@ -9,7 +9,10 @@
 
 #include <rwlock.h>
 
-int append_rw( rwlock_t* rwlock, int type );
-int dequeue( rwlock_t* rwlock );
+thr_stack_meta_t* append_rw( rwlock_t* rwlock, int type );
+bool rw_take( rwlock_t* rwlock, int type );
+void grant_waiters( rwlock_t* rwlock, bool writer_left, rw_queue_t* granted );
+void wake_granted( rw_queue_t* granted );
+void wait_for_grant( thr_stack_meta_t* self );
 
 #endif
@@ -1,6 +1,11 @@
 /** @file semaphore.c
  *  @brief implementation of semaphore library functions
  *
+ *  The count is kept with atomic adds, so wait and signal on an
+ *  uncontended semaphore are a single locked instruction each. Only when
+ *  the count drops below zero do waiters block, on cv under lock, and a
+ *  signal that finds the count negative hands a unit over through wakeups.
+ *
  *  @author Tianya Chen (andrewid: tianyac, email: tianyakc@gmail.com)
  */
 
@@ -42,6 +47,7 @@ int sem_init( sem_t *sem, int count ){
     mutex_lock( &(sem->lock) );
     sem->valid = true;
     sem->count = count;
+    sem->wakeups = 0;
     mutex_unlock( &(sem->lock) );
     return SUCCESS_RETURN;
 }
@@ -60,15 +66,17 @@ void sem_wait( sem_t *sem ){
         panic("sem_wait: trying to wait an uninitialized semaphore.");
     }
 
-    mutex_lock( &(sem->lock) );
+    /* count was more than 0, we took a unit and return immedately. */
+    if ( atomic_fetch_add( &(sem->count), -1 ) > 0 ){
+        return;
+    }
 
-    while(sem->count <= 0) {
-        /* if count is zero, suspend the thread until sem->count becomes nonzero. */
+    /* otherwise suspend the thread until a signal hands it a unit. */
+    mutex_lock( &(sem->lock) );
+    while(sem->wakeups == 0) {
         cond_wait( &(sem->cv), &(sem->lock) );
     }
-    /* count is more than 0, decrements and return immedately. */
-    (sem->count)--;
-
+    (sem->wakeups)--;
     mutex_unlock( &(sem->lock) );
     return;
 }
@@ -89,9 +97,13 @@ void sem_signal( sem_t *sem ){
         panic("sem_signal: trying to signal an uninitialized semaphore.");
     }
     
+    // increments the count, nobody to wake unless it was negative.
+    if ( atomic_fetch_add( &(sem->count), 1 ) >= 0 ){
+        return;
+    }
+
     mutex_lock( &(sem->lock) );
-    // increments the count.
-    (sem->count)++;
+    (sem->wakeups)++;
     cond_signal( &(sem->cv) );
     mutex_unlock( &(sem->lock) );
     return;
@@ -109,13 +121,14 @@ void sem_destroy( sem_t *sem ){
         panic("sem_destroy: trying to destroy a NULL semaphore.");
     }
 
-    if (sem->valid){
+    if (sem->valid == false){
         panic("sem_destroy: trying to destroy an uninitialized semaphore.");
     }
 
     mutex_lock( &(sem->lock) );
     sem->valid = false;
     sem->count = 0;
+    sem->wakeups = 0;
     mutex_unlock( &(sem->lock) );
 
     /* destroy mutex lock and condition variable */
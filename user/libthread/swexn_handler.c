@@ -1,6 +1,11 @@
 /** @file swexn_handler.c
  *  @brief software exception handler to handle thread crashes
  *
+ *  Every thread registers the handler on the exception stack in its own
+ *  metadata, and passes the metadata as the handler argument, so faults
+ *  in different threads (stack growth included) are handled on separate
+ *  stacks at the same time, without looking the thread up.
+ *
  *  @author Tianya Chen       (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
  */
 
@@ -12,14 +17,25 @@
 #include <syscall.h>
 #include <swexn_internals.h>
 #include <thr_internals.h>
+#include <error_code.h>
 #include <cond.h>
 
-/** @brief installs a general exception handler
+/** @brief returns the initial handler stack pointer of a thread
+ *  @param meta metadata of the thread
+ *  @return the top of its exception stack, word aligned
+ */
+static void *exn_stack_top(thr_stack_meta_t *meta){
+    uint32_t top = (uint32_t) &(meta->exn_stack[THR_EXN_STACK_SIZE]);
+    return (void *) (top & ~(uint32_t)(ESP_ALIGNMENT - 1));
+}
+
+/** @brief installs a general exception handler for the calling thread
+ *  @param meta metadata of the calling thread
  *  @returns void
  */
-void install_swexn(){
+void install_swexn(thr_stack_meta_t *meta){
     /* register a software exception handler */
-    if(swexn(esp3, swexn_handler, NULL, NULL) < 0){
+    if(swexn(exn_stack_top(meta), swexn_handler, meta, NULL) < 0){
         panic("install_swexn: failed to register a swexn handler.");
     }
 }
@@ -30,6 +46,17 @@ void install_swexn(){
  *  @returns void
  */
 void swexn_handler(void *arg, ureg_t *ureg){
+    thr_stack_meta_t *crashed_thread = (thr_stack_meta_t *) arg;
+
+    /* a page fault right below the stack pointer grows the thread's stack */
+    if (ureg->cause == SWEXN_CAUSE_PAGEFAULT && crashed_thread != NULL &&
+        (ureg->cr2 + POINTER32) >= ureg->esp &&
+        grow_thr_stack(crashed_thread, ureg->cr2) == SUCCESS_RETURN){
+        if(swexn(exn_stack_top(crashed_thread), swexn_handler, arg, ureg) < 0){
+            panic("swexn_handler: failed to re-register the swexn handler.");
+        }
+    }
+
     /* See intel-sys.pdf section 5.12, "Exception and Interrupt Reference" */
     switch(ureg->cause){
         case SWEXN_CAUSE_DIVIDE:
@@ -63,6 +90,13 @@ void swexn_handler(void *arg, ureg_t *ureg){
             printf("swexn: General Protection Exception\n");
             break;
         case SWEXN_CAUSE_PAGEFAULT:
+            if (crashed_thread != NULL &&
+                ureg->cr2 >= crashed_thread->stack_low &&
+                ureg->cr2 < crashed_thread->stack_floor){
+                printf("swexn: Stack Overflow into guard page at %p\n",
+                        (void*)ureg->cr2);
+                break;
+            }
             printf("swexn: Page-Fault at %p, on instruction: %p\n", 
                     (void*)ureg->cr2, (void*)ureg->eip);
             break;
@@ -79,8 +113,6 @@ void swexn_handler(void *arg, ureg_t *ureg){
             printf("swexn: Unknown Exception\n");
     }
 
-    thr_stack_meta_t *crashed_thread = find_thread_meta_by_ebp((uint32_t)ureg->ebp);
-
     mutex_lock(&(crashed_thread->meta_mutex));
     crashed_thread->exit_status = crashed_thread->arg; //choose excellent answer
     crashed_thread->thr_state = TERMINATED;
@@ -88,12 +120,19 @@ void swexn_handler(void *arg, ureg_t *ureg){
     if (crashed_thread->join_flag == JOINING){
         cond_signal( &(crashed_thread->meta_cv) );
     } 
+
+    /* like thr_exit, nobody joins a detached thread */
+    if (crashed_thread->join_flag == DETACHED){
+        mutex_lock(&g_zombie_mutex);
+        Q_INSERT_TAIL(&g_zombie_list, crashed_thread, free_stk_table_link);
+        mutex_unlock(&g_zombie_mutex);
+    }
     mutex_unlock(&(crashed_thread->meta_mutex));
     
 
     /* print out some useful info */
     printf("Crashed thread: %d \n", crashed_thread->tid);
 
-    /* terminate the thread */
-    vanish();
+    /* terminate the thread, the exception stack is part of its stack */
+    vanish_off_stack(&(crashed_thread->off_stack));
 }
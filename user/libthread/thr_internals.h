@@ -12,6 +12,7 @@
 
 #include <stdint.h>
 #include <types.h>
+#include <syscall.h>
 #include <mutex.h>
 #include <variable_queue.h>
 #include <cond_type.h>
@@ -48,9 +49,11 @@
 #define COND_INITIALIZED 1  ///< macro for initializing condition variable
 #define COND_UNINITIALIZED 0  ///< macro for destroying condition variable
 
-#define RW_UNLOCKED 0 ///< defines rwlock unlocked state
-#define RW_READING  1 ///< defines rwlock reading locked state
-#define RW_WRITING  2 ///< defines rwlock writing locked state
+/*  bits of the rwlock state word, readers are counted above the flags  */
+#define RW_STATE_WRITER 1   ///< a writer holds the lock
+#define RW_STATE_WAITING 2  ///< threads are queued, fast paths are closed
+#define RW_STATE_READER 4   ///< one reader holding the lock
+#define RW_STATE_READERS(state) ((state) >> 2)  ///< readers holding the lock
 
 #define RWLOCK_INVALID -1 ///< rwlock type for stack metadata when not in rwlock
 
@@ -62,18 +65,66 @@
 /*  flag check if the thread is joined by another thread  */
 #define NOTJOINING 0  ///< thread isn't being joined
 #define JOINING 1     ///< thread is being joined
+#define DETACHED 2    ///< thread is never joined, it is reaped once it exits
+
+/*  which queue a thread blocked in cond_wait is on  */
+#define WAITING_NONE 0      ///< taken off its queue by a waker
+#define WAITING_ON_CV 1     ///< on the queue of a condition variable
+#define WAITING_ON_MUTEX 2  ///< moved to the morph queue of its mutex
+#define WAITING_ON_TICKET 3 ///< on the ticket queue of a mutex, in mutex_timedlock
+
+/*  values of wake_flag, zero while the thread sleeps  */
+#define WAKE_SIGNALED 1   ///< set by wake_thread
+#define WAKE_TIMED_OUT 2  ///< set by the timeout thread at the deadline
 
 /** set a default tid when a tid field has not defined/assigned */
 #define UNSIGNED_TID -999
 
+/** max number of dead thread stacks kept mapped per size class in
+ *  g_free_stk_tables, any stack freed beyond this high-water mark is given
+ *  back with remove_pages */
+#define THR_STK_CACHE_HIGH_WATER 8
+
+/** number of stack size classes, class i holds stacks of (1 << i) pages */
+#define THR_STK_NUM_CLASSES 11
+/** class of stacks too large for any size class, these are never cached */
+#define THR_STK_CLASS_HUGE THR_STK_NUM_CLASSES
+
+/** bytes of stack a new thread gets mapped below its metadata */
+#define THR_STK_INIT_FRAMES PAGE_SIZE
+/** bytes mapped at the top of a new thread stack, the metadata and the
+ *  first frames, rounded up to whole pages. The rest of the stack is
+ *  reserved address space that is mapped on fault, doubling every time */
+#define THR_STK_INIT_SIZE \
+  ((sizeof(thr_stack_meta_t) + THR_STK_INIT_FRAMES + PAGE_SIZE - 1) & \
+   PAGE_ALIGN_MASK)
+/** bytes at the bottom of every thread stack that are never mapped, the
+ *  rest of the size class below the requested size is never mapped either */
+#define THR_STK_GUARD_SIZE PAGE_SIZE
+
+/** bytes of the exception stack in every thread's metadata, a full page
+ *  so the handler has room for printf */
+#define THR_EXN_STACK_SIZE PAGE_SIZE
+
+/** entries in the stack directory and in each of its tables, so that the
+ *  two levels cover the whole address space one page per entry */
+#define STK_DIR_ENTRIES 1024
+
+/** number of thread-local storage keys, see thr_key_create */
+#define THR_KEYS_MAX 32
+/** rounds of destructors run at thread exit, for destructors that set
+ *  new values */
+#define THR_KEY_DTOR_ROUNDS 4
+
 /** a struct that defines the set of information kept
  *  about each thread to manage it, its metadata.
  *  This is kept at the top of the respective thread's
  *  stack and is used in multiple different lists:
  *    - active thread table
- *    - free thread stack table
+ *    - free thread stack table (or list of detached threads that exited)
  *    - condition variable waiting queue
  *    - rwlock waiting queue
+ *    - barrier waiting queue
  *  this is thanks to the variable queue implementation,
  *  and this structure contains multiple pieces
  *  of metadata for being managed by the synchronization
@@ -85,23 +136,53 @@ typedef struct thr_stack_meta {
     void *arg;          ///< initial arguments for thread
     Q_NEW_LINK(thr_stack_meta) thr_table_link;    ///< vq link for thread table
     Q_NEW_LINK(thr_stack_meta) free_stk_table_link; ///< link for free stack
+                                                    ///< or zombie list
     Q_NEW_LINK(thr_stack_meta) cv_link;   ///< vq link for condition variable
     Q_NEW_LINK(thr_stack_meta) rw_link;   ///< vq link for reader/writer lock
+    Q_NEW_LINK(thr_stack_meta) timeout_link; ///< vq link for timed waits
+    Q_NEW_LINK(thr_stack_meta) barrier_link; ///< vq link for barrier waiters
     short thr_state;      ///< Below should be locked by meta mutex
     short root;   ///< indicates whether the respective thread is the root
     int tid;      ///< the thread ID of the respective thread
     int rw_type;  ///< the access mode of the current thread for rwlock
     int join_flag;  ///< flag for when a thread wants to join respective thread
+    volatile int creating;  ///< the creator is still in create_thread
+    volatile int off_stack; ///< set by vanish_off_stack once the stack is unused
     void *exit_status;  ///< stores the exit status of the respective thread
     mutex_t meta_mutex; ///< mutex to protect access to internal metadata
-    cond_t meta_cv; ///< controls child thread creation timing
+    cond_t meta_cv; ///< wakes the thread joining the respective thread
     uint32_t stack_high;  ///< the top of the respective thread's stack
     uint32_t stack_low;   ///< the bottom of the respective thread's stack
+    uint32_t stack_mapped_low; ///< the lowest mapped address of the stack
+    uint32_t stack_floor; ///< lowest address the stack may grow to
+    int stk_class;        ///< size class of the stack, see THR_STK_NUM_CLASSES
+    /// free range node that records the stack's range once it is released
+    struct stk_range *range_node;
+    volatile int wake_flag;   ///< deschedule reject flag, set by wake_thread
+    mutex_t *wait_mutex;  ///< mutex given to cond_wait by the thread
+    void *tls[THR_KEYS_MAX];  ///< thread-local values, indexed by thr_key_t
+    int wait_state;       ///< queue the thread waits on, see WAITING_NONE
+    unsigned int wake_deadline; ///< get_ticks() deadline of a timed wait
+    unsigned int wait_ticket;   ///< mutex ticket waited for in mutex_timedlock
     void* zero;  ///< base ebp points to, zero field is always null.
+    /// swexn handler stack, above zero so the thread's own stack never
+    /// runs into it
+    char exn_stack[THR_EXN_STACK_SIZE];
 } thr_stack_meta_t;
 
-/// declares the cv queue type struct type
-Q_NEW_HEAD(cond_queue_t, thr_stack_meta);
+/** a range of the stack region whose pages were given back to the kernel.
+ *  Ranges are kept sorted by address and coalesced with their neighbors,
+ *  so they can be carved up again for new thread stacks.
+ */
+typedef struct stk_range {
+    Q_NEW_LINK(stk_range) range_link; ///< vq link for free stack range list
+    uint32_t low;   ///< lowest address of the range
+    uint32_t high;  ///< one past the highest address of the range
+} stk_range_t;
+
+/** one table of the stack directory, holds the metadata of the thread
+ *  owning each page it covers */
+typedef thr_stack_meta_t *stk_dir_table_t[STK_DIR_ENTRIES];
 
 /// declares the thread table list type
 Q_NEW_HEAD(thr_table_t, thr_stack_meta);
@@ -109,25 +190,69 @@ Q_NEW_HEAD(thr_table_t, thr_stack_meta);
 /// decalares the free thread table list type
 Q_NEW_HEAD(free_stk_table_t, thr_stack_meta);
 
+/// declares the list type of detached threads that exited
+Q_NEW_HEAD(zombie_list_t, thr_stack_meta);
+
 /// declares the rwlock queue type
 Q_NEW_HEAD(rw_queue_t, thr_stack_meta);
 
+/// declares the timed wait list type
+Q_NEW_HEAD(timeout_list_t, thr_stack_meta);
+
+/// declares the released stack range list type
+Q_NEW_HEAD(stk_range_list_t, stk_range);
+
 /* global variables  */
 thr_stack_meta_t g_root_thr_meta; ///< root thread metadata
-unsigned int g_thr_stack_size;  ///< the size for new thread stacks
+unsigned int g_thr_stack_size;  ///< the size for thr_create thread stacks
 uint32_t g_root_stk_hi; ///< highest address of most recent thread's stack
 uint32_t g_root_stk_lo; ///< lowest address of most recent thread's stack
 uint32_t g_stacks_brk; ///< the low bound addr of the entire stack region (multiple stacks).
 
 /// global thread table to track active threads
 thr_table_t g_thr_table;
-/// global free stack table to track unallocated stack space
-free_stk_table_t g_free_stk_table;
+/// global free stack tables to track cached stacks, one per size class
+free_stk_table_t g_free_stk_tables[THR_STK_NUM_CLASSES];
+/// address ranges released to the kernel, protected by g_stack_mutex
+stk_range_list_t g_free_stk_ranges;
+/// maps the pages of every thread stack to its metadata, written under
+/// g_stack_mutex, tables are allocated on demand and never freed
+stk_dir_table_t *g_stk_dir[STK_DIR_ENTRIES];
+/// detached threads that exited but may still run, protected by g_zombie_mutex
+zombie_list_t g_zombie_list;
+/// whether each thread-local storage key is allocated
+bool g_thr_key_used[THR_KEYS_MAX];
+/// destructor of each thread-local storage key, may be NULL
+void (*g_thr_key_dtors[THR_KEYS_MAX])(void *);
+/// threads in a timed wait sorted by deadline, protected by g_timeout_mutex
+timeout_list_t g_timeout_list;
+bool g_timeout_running; ///< whether the timeout thread is serving the list
+int g_timeout_tid;      ///< tid of the last timeout thread started
 
 /* mutexes */
-mutex_t g_stack_mutex;  ///< mutex protecting stack metadata metadata
+mutex_t g_stack_mutex;  ///< protects g_stacks_brk and g_free_stk_ranges
 mutex_t g_thr_table_mutex;  ///< protects active thread table
-mutex_t g_free_stk_table_mutex; ///< protects free thread stacks table
+mutex_t g_free_stk_table_mutex; ///< protects all free thread stack tables
+mutex_t g_timeout_mutex;  ///< protects the timed wait list
+mutex_t g_timeout_start_mutex;  ///< serializes starting the timeout thread
+mutex_t g_thr_key_mutex;  ///< protects the thread-local storage keys
+mutex_t g_zombie_mutex;  ///< protects the list of exited detached threads
+
+/** @brief finds the metadata of the thread stack holding an address
+ *  @param addr the address
+ *
+ *  a thread's own stack pages stay in the directory as long as it runs,
+ *  so looking up an address on the caller's stack needs no lock
+ *
+ *  @return the metadata, NULL if addr isn't on a thread stack
+ */
+static inline thr_stack_meta_t *stk_dir_lookup(uint32_t addr){
+  stk_dir_table_t *table = g_stk_dir[addr / (PAGE_SIZE * STK_DIR_ENTRIES)];
+  if (table == NULL){
+    return NULL;
+  }
+  return (*table)[(addr / PAGE_SIZE) % STK_DIR_ENTRIES];
+}
 
 /** @brief returns current value of %ebp
  *  @return current value of %ebp
@@ -143,15 +268,36 @@ uint32_t read_ebp(void);
  */
 int create_new_thread(void *ebp, void *esp);
 unsigned int round_up_stack_size(unsigned int size);
+int stk_size_class(unsigned int size);
+unsigned int stk_class_size(int stk_class);
+int create_thread(void *(*func)(void *), void *arg, unsigned int size,
+                  unsigned int flags);
 int malloc_init();
+int malloc_cache_init();
 int initialize_stack_meta(thr_stack_meta_t* stack_meta_ptr, bool first_init,
-                          void *(*func)(void *), void *arg);
+                          unsigned int size, void *(*func)(void *), void *arg);
 thr_stack_meta_t* find_current_thread_meta();
 thr_stack_meta_t* find_thread_meta_by_ebp( uint32_t ebp );
 thr_stack_meta_t* find_thread_meta_by_tid( int tid );
 thr_stack_meta_t* allocate_init_thr_stack(unsigned int size, void *(*func)(void *), void *arg);
 void free_thr_stack(thr_stack_meta_t* stack_meta_ptr);
+void reap_detached_threads(void);
+void run_thr_key_dtors(thr_stack_meta_t* meta);
+void wake_thread(thr_stack_meta_t* meta);
+void wait_for_wake(thr_stack_meta_t* meta);
+int wait_for_wake_until(thr_stack_meta_t* meta, unsigned int deadline);
+bool deadline_passed(unsigned int deadline);
+void mutex_requeue(mutex_t *mp, thr_stack_meta_t* meta);
+bool mutex_unqueue(mutex_t *mp, thr_stack_meta_t* meta);
+int grow_thr_stack(thr_stack_meta_t* stack_meta_ptr, uint32_t addr);
 void run_thr_func(void *(*func)(void *), void *arg);
+
+/** @brief sets *off_stack and vanishes without touching the stack again
+ *  @param off_stack the off_stack field of the calling thread's metadata
+ *  @return never returns
+ */
+void vanish_off_stack(volatile int *off_stack);
+void install_swexn(thr_stack_meta_t* meta);
 void print_thr_table( thr_table_t* header );
 void print_thr_stack_meta_by_tid( int tid );
 void print_thr_stack_meta( thr_stack_meta_t* meta );
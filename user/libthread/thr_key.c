@@ -0,0 +1,180 @@
+/** @file thr_key.c
+ *  @brief implementation of thread-local storage keys
+ *
+ *  The values live in the tls array of every thread's stack metadata, so
+ *  setting and getting one is a stack directory lookup of the calling
+ *  thread's metadata plus an index, in constant time and without a lock.
+ *  Only creating and deleting keys, which is rare, takes g_thr_key_mutex.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <thread.h>
+#include <thread_ext.h>
+#include <mutex.h>
+#include "thr_internals.h"
+#include "error_code.h"
+
+/** @brief allocates a thread-local storage key
+ *  @param key where to store the key
+ *  @param destructor called at thread exit with the thread's value for the
+ *         key, if it is not NULL, may be NULL
+ *
+ *  every thread's value for the new key starts out NULL
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int thr_key_create( thr_key_t *key, void (*destructor)(void *) )
+{
+  if ( key == NULL )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  mutex_lock( &g_thr_key_mutex );
+
+  thr_key_t new_key;
+  for ( new_key = 0; new_key < THR_KEYS_MAX; new_key++ )
+  {
+    if ( !g_thr_key_used[new_key] )
+    {
+      break;
+    }
+  }
+
+  if ( new_key == THR_KEYS_MAX )
+  {
+    mutex_unlock( &g_thr_key_mutex );
+    return ERROR_NO_KEYS;
+  }
+
+  // clear the values a deleted key with this slot may have left behind
+  thr_stack_meta_t *meta;
+  mutex_lock( &g_thr_table_mutex );
+  Q_FOREACH( meta, &g_thr_table, thr_table_link )
+  {
+    (meta->tls[new_key]) = NULL;
+  }
+  mutex_unlock( &g_thr_table_mutex );
+
+  g_thr_key_used[new_key] = true;
+  g_thr_key_dtors[new_key] = destructor;
+  mutex_unlock( &g_thr_key_mutex );
+
+  *key = new_key;
+  return SUCCESS_RETURN;
+}
+
+/** @brief frees a thread-local storage key
+ *  @param key the key
+ *
+ *  no destructor is called, cleaning up the values is up to the caller
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int thr_key_delete( thr_key_t key )
+{
+  if ( key >= THR_KEYS_MAX )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  mutex_lock( &g_thr_key_mutex );
+  if ( !g_thr_key_used[key] )
+  {
+    mutex_unlock( &g_thr_key_mutex );
+    return ERROR_INVALID_ARGUMENT;
+  }
+  g_thr_key_used[key] = false;
+  g_thr_key_dtors[key] = NULL;
+  mutex_unlock( &g_thr_key_mutex );
+
+  return SUCCESS_RETURN;
+}
+
+/** @brief sets the calling thread's value for a key
+ *  @param key the key
+ *  @param value the value
+ *  @return 0 on success, negative number on failure
+ */
+int thr_setspecific( thr_key_t key, void *value )
+{
+  if ( key >= THR_KEYS_MAX )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  thr_stack_meta_t *meta = find_current_thread_meta();
+  if ( meta == NULL )
+  {
+    return ERROR_INVALID_TID;
+  }
+
+  (meta->tls[key]) = value;
+  return SUCCESS_RETURN;
+}
+
+/** @brief gets the calling thread's value for a key
+ *  @param key the key
+ *  @return the value, NULL if none was set
+ */
+void *thr_getspecific( thr_key_t key )
+{
+  if ( key >= THR_KEYS_MAX )
+  {
+    return NULL;
+  }
+
+  thr_stack_meta_t *meta = find_current_thread_meta();
+  if ( meta == NULL )
+  {
+    return NULL;
+  }
+
+  return (meta->tls[key]);
+}
+
+/** @brief runs the key destructors on the values of an exiting thread
+ *  @param meta metadata of the calling thread
+ *
+ *  a destructor may set values again, so this goes over the keys up to
+ *  THR_KEY_DTOR_ROUNDS times
+ *
+ *  @return void
+ */
+void run_thr_key_dtors( thr_stack_meta_t *meta )
+{
+  int round;
+  for ( round = 0; round < THR_KEY_DTOR_ROUNDS; round++ )
+  {
+    bool ran = false;
+    thr_key_t key;
+
+    for ( key = 0; key < THR_KEYS_MAX; key++ )
+    {
+      void *value = (meta->tls[key]);
+      if ( value == NULL )
+      {
+        continue;
+      }
+
+      mutex_lock( &g_thr_key_mutex );
+      void (*destructor)(void *) = g_thr_key_dtors[key];
+      mutex_unlock( &g_thr_key_mutex );
+
+      (meta->tls[key]) = NULL;
+      if ( destructor != NULL )
+      {
+        destructor( value );
+        ran = true;
+      }
+    }
+
+    if ( !ran )
+    {
+      break;
+    }
+  }
+}
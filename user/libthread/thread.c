@@ -8,16 +8,20 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <simics.h>
 #include <contracts.h>
 #include <syscall.h>
+#include <syscall_inline.h>
 #include <malloc.h>
 #include <thread.h>
+#include <thread_ext.h>
 #include <error_code.h>
 #include "thr_internals.h"
 #include <swexn_internals.h>
 #include <mutex.h>
 #include <cond.h>
+#include <atomic.h>
 
 /* global variables  */
 /** global variable for the root
@@ -32,9 +36,6 @@ thr_stack_meta_t g_root_thr_meta;
  *  @return 0 on success, negative number on failure
  */
 int thr_init(unsigned int size){
-  // regsiter a general software exception handler
-  install_swexn();
-
   // the size must a multiple of PAGE_SIZE.
   g_thr_stack_size = round_up_stack_size(size + sizeof(thr_stack_meta_t));
 
@@ -49,12 +50,20 @@ int thr_init(unsigned int size){
   ret |= mutex_init( &g_stack_mutex );
   ret |= mutex_init( &g_thr_table_mutex );
   ret |= mutex_init( &g_free_stk_table_mutex );
+  ret |= mutex_init( &g_timeout_mutex );
+  ret |= mutex_init( &g_timeout_start_mutex );
+  ret |= mutex_init( &g_thr_key_mutex );
+  ret |= mutex_init( &g_zombie_mutex );
   ret |= mutex_init( &(g_root_thr_meta.meta_mutex) );
   ret |= cond_init( &(g_root_thr_meta.meta_cv) );
   if (ret < 0) {
     mutex_destroy( &g_stack_mutex );
     mutex_destroy( &g_thr_table_mutex );
     mutex_destroy( &g_free_stk_table_mutex );
+    mutex_destroy( &g_timeout_mutex );
+    mutex_destroy( &g_timeout_start_mutex );
+    mutex_destroy( &g_thr_key_mutex );
+    mutex_destroy( &g_zombie_mutex );
     mutex_destroy( &(g_root_thr_meta.meta_mutex) );
     cond_destroy( &(g_root_thr_meta.meta_cv) );
     return ERROR_THR_INIT_FAILED;
@@ -62,7 +71,15 @@ int thr_init(unsigned int size){
 
   //initialize thread stack table
   Q_INIT_HEAD(&g_thr_table);
-  Q_INIT_HEAD(&g_free_stk_table);
+  int stk_class;
+  for (stk_class = 0; stk_class < THR_STK_NUM_CLASSES; stk_class++){
+    Q_INIT_HEAD(&g_free_stk_tables[stk_class]);
+  }
+  Q_INIT_HEAD(&g_free_stk_ranges);
+  Q_INIT_HEAD(&g_timeout_list);
+  Q_INIT_HEAD(&g_zombie_list);
+  g_timeout_running = false;
+  g_timeout_tid = UNSIGNED_TID;
 
   // intialize g_root_thr_meta.
   (g_root_thr_meta.ret_addr) = &thr_exit;
@@ -73,13 +90,25 @@ int thr_init(unsigned int size){
   Q_INIT_ELEM(&g_root_thr_meta, free_stk_table_link);
   Q_INIT_ELEM(&g_root_thr_meta, cv_link);
   Q_INIT_ELEM(&g_root_thr_meta, rw_link);
+  Q_INIT_ELEM(&g_root_thr_meta, timeout_link);
+  Q_INIT_ELEM(&g_root_thr_meta, barrier_link);
   (g_root_thr_meta.join_flag) = NOTJOINING;
+  (g_root_thr_meta.creating) = 0;
+  (g_root_thr_meta.off_stack) = 0;
   (g_root_thr_meta.rw_type) = RWLOCK_INVALID;
+  (g_root_thr_meta.wake_flag) = 0;
+  (g_root_thr_meta.wait_mutex) = NULL;
+  (g_root_thr_meta.wait_state) = WAITING_NONE;
+  memset( g_root_thr_meta.tls, 0, sizeof(g_root_thr_meta.tls) );
   (g_root_thr_meta.exit_status) = NULL;
   (g_root_thr_meta.root) = IS_ROOT;
-  (g_root_thr_meta.tid) = gettid(); //thr_getid() no longer calls gettid();
+  (g_root_thr_meta.tid) = inline_gettid(); //thr_getid() no longer calls gettid();
   (g_root_thr_meta.stack_high) = get_root_stack_high();
   (g_root_thr_meta.stack_low) = get_root_stack_low();
+  (g_root_thr_meta.stack_mapped_low) = (g_root_thr_meta.stack_low);
+  (g_root_thr_meta.stack_floor) = (g_root_thr_meta.stack_low);
+  (g_root_thr_meta.stk_class) = THR_STK_CLASS_HUGE;
+  (g_root_thr_meta.range_node) = NULL;
   (g_root_thr_meta.zero) = 0;
 
   // add root entry as the first thread and CAN'T be removed from g_thr_table
@@ -87,11 +116,21 @@ int thr_init(unsigned int size){
   Q_INSERT_FRONT( &g_thr_table, &g_root_thr_meta, thr_table_link);
   mutex_unlock( &g_thr_table_mutex );
 
+  // per-thread allocation caches find their thread through the table
+  if ( malloc_cache_init() < 0 )
+  {
+    panic("thr_init: malloc cache initialization failed!");
+  }
+
   // get the current g_stacks_brk, same as root stack low
   mutex_lock( &g_stack_mutex );
   g_stacks_brk = (g_root_thr_meta.stack_low);
   mutex_unlock( &g_stack_mutex );
 
+  // regsiter a general software exception handler, on the exception stack
+  // of the root metadata instead of the autostack one
+  install_swexn( &g_root_thr_meta );
+
   return SUCCESS_RETURN;
 }
 
@@ -102,14 +141,53 @@ int thr_init(unsigned int size){
  *  @return tid of child thread on success, negative number on failure
  */
 int thr_create(void *(*func)(void *), void *arg){
+  return create_thread(func, arg, g_thr_stack_size, 0);
+}
+
+/** @brief creates a new thread with its own stack size and options
+ *  @param func pointer to the function to start the child thread in
+ *  @param arg set of arguments to pass into child threads initial function
+ *  @param stack_size the maximum size of the child thread's stack, only
+ *         the pages the thread actually touches get mapped, 0 for the size
+ *         given to thr_init
+ *  @param flags THR_CREATE_DETACHED to create the thread detached, or 0
+ *  @return tid of child thread on success, negative number on failure
+ */
+int thr_create_ex(void *(*func)(void *), void *arg, unsigned int stack_size,
+                  unsigned int flags){
+  unsigned int size = (stack_size == 0) ? g_thr_stack_size :
+                      round_up_stack_size(stack_size + sizeof(thr_stack_meta_t));
+  return create_thread(func, arg, size, flags);
+}
+
+/** @brief creates a new thread on a stack of the given size
+ *  @param func pointer to the function to start the child thread in
+ *  @param arg set of arguments to pass into child threads initial function
+ *  @param size the size of the child's stack including its metadata,
+ *         a multiple of PAGE_SIZE
+ *  @param flags THR_CREATE_DETACHED to create the thread detached, or 0
+ *  @return tid of child thread on success, negative number on failure
+ */
+int create_thread(void *(*func)(void *), void *arg, unsigned int size,
+                  unsigned int flags){
+  // stacks of detached threads that exited are the first ones to reuse
+  reap_detached_threads();
+
   // allocate the thr_stack, thread safe
-  thr_stack_meta_t* stack_meta_ptr = allocate_init_thr_stack(g_thr_stack_size, func, arg);
+  thr_stack_meta_t* stack_meta_ptr = allocate_init_thr_stack(size, func, arg);
 
   if (stack_meta_ptr == NULL){
     printf("thr_create: can't allocate memory for new thread stack.\n");
     return ERROR_THR_CREATE_FAILED;
   }
 
+  // the child may exit, and be joined or reaped, before we are done with
+  // its metadata, free_thr_stack waits for this to clear on every path
+  stack_meta_ptr->creating = 1;
+  if (flags & THR_CREATE_DETACHED){
+    stack_meta_ptr->join_flag = DETACHED;
+  }
+
   void *ebp = &(stack_meta_ptr->zero); // the base item on the stack
   void *esp = &(stack_meta_ptr->ret_addr);
   int tid = create_new_thread(ebp, esp); // return is equal to the return of thread_fork_int
@@ -117,6 +195,7 @@ int thr_create(void *(*func)(void *), void *arg){
 
   // child thread will not run the code below
   if (tid < 0){
+    stack_meta_ptr->creating = 0;
     free_thr_stack(stack_meta_ptr);
 
     // signal error
@@ -124,12 +203,10 @@ int thr_create(void *(*func)(void *), void *arg){
     return ERROR_THR_CREATE_FAILED;
   }
 
-  mutex_lock( & stack_meta_ptr->meta_mutex );
+  // the child publishes the same tid itself, so it never waits on us, and
+  // only the child moves its state on, it may have already terminated
   stack_meta_ptr->tid = tid;
-  stack_meta_ptr->thr_state = RUNNABLE;
-  cond_signal( &(stack_meta_ptr->meta_cv) );
-  mutex_unlock( &stack_meta_ptr->meta_mutex );
-
+  atomic_store((volatile unsigned int *)&(stack_meta_ptr->creating), 0);
 
   return tid;
 
@@ -152,13 +229,13 @@ int thr_join(int tid, void **statusp){
     return ERROR_INVALID_TID;
   }
 
-  if ((exit_thread->join_flag) == JOINING || (exit_thread->tid) != tid ){
+  if ((exit_thread->join_flag) != NOTJOINING || (exit_thread->tid) != tid ){
     return ERROR_MULTIPLE_JOINS;
   }
 
   mutex_lock( &(exit_thread->meta_mutex) );
 
-  if ((exit_thread->join_flag) == JOINING || (exit_thread->tid) != tid ){
+  if ((exit_thread->join_flag) != NOTJOINING || (exit_thread->tid) != tid ){
     mutex_unlock( &(exit_thread->meta_mutex) );
     return ERROR_MULTIPLE_JOINS;
   }
@@ -183,6 +260,43 @@ int thr_join(int tid, void **statusp){
   return SUCCESS_RETURN;
 }
 
+/** @brief lets a thread's resources go without anyone joining it
+ *  @param tid thread id of the thread to detach
+ *
+ *  a thread that already exited is freed right away, any other one is
+ *  freed after it exits
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int thr_detach(int tid){
+  thr_stack_meta_t *detach_thread = NULL;
+
+  if ( (detach_thread = find_thread_meta_by_tid(tid)) == NULL )
+  {
+    return ERROR_INVALID_TID;
+  }
+
+  mutex_lock( &(detach_thread->meta_mutex) );
+
+  if ((detach_thread->join_flag) != NOTJOINING || (detach_thread->tid) != tid ){
+    mutex_unlock( &(detach_thread->meta_mutex) );
+    return ERROR_MULTIPLE_JOINS;
+  }
+  (detach_thread->join_flag) = DETACHED;
+
+  // thr_exit checks the flag under the same mutex, so a thread that has
+  // not terminated yet will put itself on the zombie list
+  bool terminated = ( detach_thread->thr_state == TERMINATED );
+  mutex_unlock( &(detach_thread->meta_mutex) );
+
+  if ( terminated )
+  {
+    free_thr_stack( detach_thread );
+  }
+
+  return SUCCESS_RETURN;
+}
+
 /** @brief causes a thread to finish and passes on exit status
  *  @param status the exit status of the calling thread
  *  @return never returns
@@ -194,6 +308,16 @@ void thr_exit(void *status)
 
   affirm_msg( exit_thread != NULL, "thr_exit: Thread cannot find its own stack metadata!\n");
 
+  // a detached thread frees the ones that exited before it, while its own
+  // thread-local allocation cache is still there to take their memory
+  if ( exit_thread->join_flag == DETACHED )
+  {
+    reap_detached_threads();
+  }
+
+  // thread-local values are destroyed while the thread can still run code
+  run_thr_key_dtors( exit_thread );
+
   mutex_lock( &(exit_thread->meta_mutex) );
   (exit_thread->exit_status) = status;
   (exit_thread->thr_state) = TERMINATED;
@@ -204,10 +328,18 @@ void thr_exit(void *status)
   {
     cond_signal( &(exit_thread->meta_cv) );
   }
+
+  // nobody will join a detached thread, the next reaper frees its stack
+  // once it is off it
+  if ( exit_thread->join_flag == DETACHED )
+  {
+    mutex_lock( &g_zombie_mutex );
+    Q_INSERT_TAIL( &g_zombie_list, exit_thread, free_stk_table_link );
+    mutex_unlock( &g_zombie_mutex );
+  }
   mutex_unlock( &(exit_thread->meta_mutex) );
 
-  lprintf("exit thread: %d\n", exit_thread->tid);
-  vanish();
+  vanish_off_stack( &(exit_thread->off_stack) );
 }
 
 /** @brief figures out tid of calling thread
@@ -218,12 +350,12 @@ int thr_getid(void)
   thr_stack_meta_t *current_thread = find_current_thread_meta();
   if ( current_thread == NULL )
   {
-    return gettid();
+    return inline_gettid();
   }
 
   if ( current_thread->tid == UNSIGNED_TID )
   {
-    return gettid();
+    return inline_gettid();
   }
 
   return current_thread->tid;
@@ -239,7 +371,7 @@ int thr_yield(int tid)
 {
   if ( tid == YIELD_ANYONE )
   {
-    return yield(tid);
+    return inline_yield(tid);
   }
   else
   {
@@ -249,5 +381,5 @@ int thr_yield(int tid)
       return ERROR_INVALID_TID;
     }
   }
-  return yield(tid);
+  return inline_yield(tid);
 }
@@ -9,8 +9,11 @@
 #include <simics.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <malloc.h>
 #include <thread.h>
 #include <syscall.h>
+#include <syscall_inline.h>
 #include <error_code.h>
 #include <mutex.h>
 #include <cond.h>
@@ -28,6 +31,29 @@ unsigned int round_up_stack_size(unsigned int size){
   return (PAGE_SIZE - (size % PAGE_SIZE)) + size;
 }
 
+/** @brief finds the size class that fits a stack of the given size
+ *  @param size the stack size, a multiple of PAGE_SIZE
+ *  @return the smallest class whose stacks hold size bytes,
+ *          THR_STK_CLASS_HUGE if no class is big enough
+ */
+int stk_size_class(unsigned int size){
+  unsigned int pages = size / PAGE_SIZE;
+  int stk_class = 0;
+
+  while (stk_class < THR_STK_NUM_CLASSES && (1u << stk_class) < pages){
+    stk_class++;
+  }
+  return stk_class;
+}
+
+/** @brief returns the size of the stacks in a size class
+ *  @param stk_class the size class, less than THR_STK_NUM_CLASSES
+ *  @return the stack size in bytes
+ */
+unsigned int stk_class_size(int stk_class){
+  return (1u << stk_class) * PAGE_SIZE;
+}
+
 /** @brief gets the calling thread's metadata
  *  @return a pointer to the metadata struct on success, NULL on failure
  */
@@ -47,16 +73,24 @@ thr_stack_meta_t* find_current_thread_meta(){
 /** @brief returns the metadata for a given thread with input ebp
  *  @param ebp the given ebp address as unsigned int
  *
+ *  thread stacks are found through the stack directory in constant time,
+ *  anything else only matches the root stack (fibers run on the heap and
+ *  have no metadata)
+ *
+ *  requires ebp is on the caller's own stack, or on a stack that can't
+ *  be freed meanwhile
+ *
  *  @returns a pointer to the metadata struct of the thread if it exists in the
  *           task, NULL otherwise
  */
 thr_stack_meta_t* find_thread_meta_by_ebp ( uint32_t ebp ){
-  // iterate through the thread table
-  thr_stack_meta_t *current_thread;
-  Q_FOREACH(current_thread, &g_thr_table, thr_table_link) {
-    if (ebp <= current_thread->stack_high && ebp >= current_thread->stack_low){
-      return current_thread;
-    }
+  thr_stack_meta_t *current_thread = stk_dir_lookup(ebp);
+  if (current_thread != NULL){
+    return current_thread;
+  }
+
+  if (ebp <= g_root_thr_meta.stack_high && ebp >= g_root_thr_meta.stack_low){
+    return &g_root_thr_meta;
   }
   return NULL;
 }
@@ -82,24 +116,27 @@ thr_stack_meta_t* find_thread_meta_by_tid( int tid ){
 
   // iterate through the thread table
   thr_stack_meta_t *current_thread;
+  mutex_lock( &g_thr_table_mutex );
   Q_FOREACH(current_thread, &g_thr_table, thr_table_link) {
     if (current_thread->tid == tid){
-      return current_thread;
+      break;
     }
   }
-  return NULL;
+  mutex_unlock( &g_thr_table_mutex );
+  return current_thread;
 }
 
 /** @brief loads the stack_meta_ptr with default metadata info
  *         and initializes it
  *  @param stack_meta_ptr pointer to the stack metadata struct to fill
  *  @param first_init tells if this stack struct hasn't been initialized before
+ *  @param size the size of the whole stack, metadata included
  *  @param func pointer to the function that the child thread should start at
  *  @param arg initial arguments for the child thread
  *  @return 0 on success, negative number on failure
  */
 int initialize_stack_meta(thr_stack_meta_t* stack_meta_ptr, bool first_init,
-                          void *(*func)(void *), void *arg){
+                          unsigned int size, void *(*func)(void *), void *arg){
 
   if (stack_meta_ptr == NULL || func == NULL){
     return ERROR_INIT_STACK_META_FAILED;
@@ -108,10 +145,12 @@ int initialize_stack_meta(thr_stack_meta_t* stack_meta_ptr, bool first_init,
   assert( (((uint32_t) stack_meta_ptr) % ESP_ALIGNMENT) == 0 );
 
   uint32_t thr_stack_high = (uint32_t)stack_meta_ptr + sizeof(thr_stack_meta_t);
-  uint32_t thr_stack_low = thr_stack_high - g_thr_stack_size;
+  uint32_t thr_stack_low = thr_stack_high - size;
 
-  // only initialize the meta_mutex and meta_cv on first init
+  // only initialize the meta_mutex and meta_cv on first init, a cached
+  // stack also keeps the pages it has grown so far
   if (first_init){
+    stack_meta_ptr->stack_mapped_low = thr_stack_high - THR_STK_INIT_SIZE;
     int ret = 0;
     ret |= mutex_init( &(stack_meta_ptr->meta_mutex) );
     ret |= cond_init( &(stack_meta_ptr->meta_cv) );
@@ -124,6 +163,8 @@ int initialize_stack_meta(thr_stack_meta_t* stack_meta_ptr, bool first_init,
   Q_INIT_ELEM(stack_meta_ptr, free_stk_table_link);
   Q_INIT_ELEM(stack_meta_ptr, cv_link);
   Q_INIT_ELEM(stack_meta_ptr, rw_link);
+  Q_INIT_ELEM(stack_meta_ptr, timeout_link);
+  Q_INIT_ELEM(stack_meta_ptr, barrier_link);
 
   mutex_lock( &(stack_meta_ptr->meta_mutex) );
   stack_meta_ptr->ret_addr = &thr_exit;
@@ -131,18 +172,320 @@ int initialize_stack_meta(thr_stack_meta_t* stack_meta_ptr, bool first_init,
   stack_meta_ptr->arg = arg;
   stack_meta_ptr->thr_state = UNSTARTED;
   stack_meta_ptr->join_flag = NOTJOINING;
+  stack_meta_ptr->creating = 0;
+  stack_meta_ptr->off_stack = 0;
   stack_meta_ptr->rw_type = RWLOCK_INVALID;
   stack_meta_ptr->exit_status = NULL;
+  stack_meta_ptr->wake_flag = 0;
+  stack_meta_ptr->wait_mutex = NULL;
+  stack_meta_ptr->wait_state = WAITING_NONE;
+  memset(stack_meta_ptr->tls, 0, sizeof(stack_meta_ptr->tls));
   stack_meta_ptr->root = IS_NOT_ROOT;
   stack_meta_ptr->tid = UNSIGNED_TID;
   stack_meta_ptr->stack_high = thr_stack_high;
   stack_meta_ptr->stack_low = thr_stack_low;
+  stack_meta_ptr->stk_class = stk_size_class(size);
   stack_meta_ptr->zero = NULL;
   mutex_unlock( &(stack_meta_ptr->meta_mutex) );
 
   return SUCCESS_RETURN;
 }
 
+/** @brief carves a new stack out of the stack region
+ *  @param size the size of the stack to carve, a multiple of PAGE_SIZE
+ *
+ *  reuses a released range first (first fit, taking the top of the range),
+ *  and only lowers g_stacks_brk when no released range is big enough.
+ *
+ *  requires caller owns g_stack_mutex
+ *
+ *  @return the lowest address of the new stack
+ */
+static uint32_t carve_stk_range(unsigned int size){
+  stk_range_t *range;
+  Q_FOREACH(range, &g_free_stk_ranges, range_link) {
+    if ((range->high - range->low) >= size){
+      range->high -= size;
+      uint32_t stack_low = range->high;
+
+      if (range->high == range->low){
+        Q_REMOVE(&g_free_stk_ranges, range, range_link);
+        free(range);
+      }
+      return stack_low;
+    }
+  }
+
+  g_stacks_brk = g_stacks_brk & PAGE_ALIGN_MASK;
+  g_stacks_brk -= size;
+  return g_stacks_brk;
+}
+
+/** @brief puts a released range back into the sorted free range list
+ *  @param range the range whose pages have already been removed
+ *
+ *  coalesces the range with its neighbors, and gives the lowest range
+ *  back to g_stacks_brk when it touches the break.
+ *
+ *  requires caller owns g_stack_mutex
+ *
+ *  @return void
+ */
+static void insert_stk_range(stk_range_t *range){
+  stk_range_t *next;
+  Q_FOREACH(next, &g_free_stk_ranges, range_link) {
+    if (next->low > range->low){
+      break;
+    }
+  }
+
+  if (next == NULL){
+    Q_INSERT_TAIL(&g_free_stk_ranges, range, range_link);
+  } else {
+    Q_INSERT_BEFORE(&g_free_stk_ranges, next, range, range_link);
+  }
+
+  // merge with the range right below
+  stk_range_t *prev = Q_GET_PREV(range, range_link);
+  if (prev != NULL && prev->high == range->low){
+    prev->high = range->high;
+    Q_REMOVE(&g_free_stk_ranges, range, range_link);
+    free(range);
+    range = prev;
+  }
+
+  // merge with the range right above
+  if (next != NULL && range->high == next->low){
+    range->high = next->high;
+    Q_REMOVE(&g_free_stk_ranges, next, range_link);
+    free(next);
+  }
+
+  // the lowest range sitting on the break just moves the break back up
+  range = Q_GET_FRONT(&g_free_stk_ranges);
+  if (range != NULL && range->low == g_stacks_brk){
+    g_stacks_brk = range->high;
+    Q_REMOVE(&g_free_stk_ranges, range, range_link);
+    free(range);
+  }
+}
+
+/** @brief points the stack directory entries of a range at a thread
+ *  @param low the lowest address of the range
+ *  @param high one past the highest address of the range
+ *  @param meta the metadata of the thread owning the range, NULL to clear
+ *
+ *  requires caller owns g_stack_mutex
+ *
+ *  @return 0 on success, negative number if a directory table couldn't be
+ *          allocated, the entries set so far are left for the caller to clear
+ */
+static int set_stk_dir(uint32_t low, uint32_t high, thr_stack_meta_t* meta){
+  uint32_t addr;
+  for (addr = low; addr < high; addr += PAGE_SIZE){
+    stk_dir_table_t **slot = &g_stk_dir[addr / (PAGE_SIZE * STK_DIR_ENTRIES)];
+
+    if (*slot == NULL){
+      if (meta == NULL){
+        continue;
+      }
+      *slot = malloc(sizeof(stk_dir_table_t));
+      if (*slot == NULL){
+        return ERROR_MALLOC_FAILED;
+      }
+      memset(*slot, 0, sizeof(stk_dir_table_t));
+    }
+    (**slot)[(addr / PAGE_SIZE) % STK_DIR_ENTRIES] = meta;
+  }
+  return SUCCESS_RETURN;
+}
+
+/** @brief puts a dead stack into the free stack table of its size class
+ *  @param stack_meta_ptr metadata of a stack that is off the thread table
+ *  @param force cache the stack even past THR_STK_CACHE_HIGH_WATER
+ *  @return true if the stack was cached, false if the caller must release it
+ */
+static bool cache_thr_stack(thr_stack_meta_t* stack_meta_ptr, bool force){
+  int stk_class = stack_meta_ptr->stk_class;
+  if (stk_class == THR_STK_CLASS_HUGE){
+    return false;
+  }
+
+  free_stk_table_t *table = &g_free_stk_tables[stk_class];
+  mutex_lock( &g_free_stk_table_mutex );
+  if ( !force && table->size >= THR_STK_CACHE_HIGH_WATER ){
+    mutex_unlock( &g_free_stk_table_mutex );
+    return false;
+  }
+  Q_INSERT_TAIL( table, stack_meta_ptr, free_stk_table_link );
+  mutex_unlock( &g_free_stk_table_mutex );
+  return true;
+}
+
+/** @brief finds the base of the next growth chunk below a mapped stack part
+ *  @param floor the lowest address the stack may grow to
+ *  @param stack_high the top of the stack
+ *  @param mapped_low the lowest mapped address of the stack
+ *
+ *  every growth step doubles the mapped part of the stack, clamped at the
+ *  floor, so the chunk bases that remove_pages needs can be recomputed
+ *  from the stack bounds alone.
+ *
+ *  @return the base address of the next chunk
+ */
+static uint32_t next_stk_chunk(uint32_t floor, uint32_t stack_high,
+                               uint32_t mapped_low){
+  uint32_t mapped = stack_high - mapped_low;
+
+  if (mapped > (stack_high - floor) - mapped){
+    return floor;
+  }
+  return mapped_low - mapped;
+}
+
+/** @brief maps more of a thread stack so that addr becomes accessible
+ *  @param stack_meta_ptr metadata of the thread whose stack grows
+ *  @param addr the faulting address below the mapped part of the stack
+ *
+ *  requires addr lies between the floor and the mapped part
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int grow_thr_stack(thr_stack_meta_t* stack_meta_ptr, uint32_t addr){
+  uint32_t floor = stack_meta_ptr->stack_floor;
+  uint32_t stack_high = stack_meta_ptr->stack_high;
+
+  if (addr < floor || addr >= stack_meta_ptr->stack_mapped_low){
+    return ERROR_STACK_OVERFLOW;
+  }
+
+  while (stack_meta_ptr->stack_mapped_low > addr){
+    uint32_t mapped_low = stack_meta_ptr->stack_mapped_low;
+    uint32_t chunk = next_stk_chunk(floor, stack_high, mapped_low);
+
+    if (new_pages((void *)chunk, mapped_low - chunk) < 0){
+      return ERROR_STACK_OVERFLOW;
+    }
+    stack_meta_ptr->stack_mapped_low = chunk;
+  }
+  return SUCCESS_RETURN;
+}
+
+/** @brief removes every mapped chunk of a thread stack below the first
+ *  @param floor the lowest address the stack may grow to
+ *  @param stack_high the top of the stack
+ *  @param mapped_low the lowest mapped address of the stack
+ *  @return 0 on success, negative number on failure
+ */
+static int remove_stk_chunks(uint32_t floor, uint32_t stack_high,
+                             uint32_t mapped_low){
+  uint32_t chunk = stack_high - THR_STK_INIT_SIZE;
+  int ret = 0;
+
+  while (chunk > mapped_low){
+    chunk = next_stk_chunk(floor, stack_high, chunk);
+    ret |= remove_pages((void *)chunk);
+  }
+  return ret;
+}
+
+/** @brief removes every mapped chunk of a thread stack
+ *  @param floor the lowest address the stack may grow to
+ *  @param stack_high the top of the stack
+ *  @param mapped_low the lowest mapped address of the stack
+ *  @return 0 on success, negative number on failure
+ */
+static int unmap_thr_stack(uint32_t floor, uint32_t stack_high,
+                           uint32_t mapped_low){
+  int ret = remove_pages((void *)(stack_high - THR_STK_INIT_SIZE));
+  return ret | remove_stk_chunks(floor, stack_high, mapped_low);
+}
+
+/** @brief gives the pages of a dead thread stack back to the kernel
+ *  @param stack_meta_ptr metadata of a stack that is off the thread table
+ *
+ *  the address range is recorded with the range node allocated along
+ *  with the stack, so releasing a stack never needs memory.
+ *
+ *  @return void
+ */
+static void release_thr_stack(thr_stack_meta_t* stack_meta_ptr){
+  stk_range_t *range = stack_meta_ptr->range_node;
+  uint32_t stack_low = stack_meta_ptr->stack_low;
+  uint32_t stack_high = stack_meta_ptr->stack_high;
+  uint32_t mapped_low = stack_meta_ptr->stack_mapped_low;
+  uint32_t floor = stack_meta_ptr->stack_floor;
+
+  // the metadata lives on the stack, tear it down before the pages go away
+  cond_destroy( &(stack_meta_ptr->meta_cv) );
+  mutex_destroy( &(stack_meta_ptr->meta_mutex) );
+
+  if (unmap_thr_stack(floor, stack_high, mapped_low) < 0){
+    printf("release_thr_stack: can't remove stack pages at %x.\n",
+           (unsigned int) stack_low);
+    free(range);
+    return;
+  }
+
+  Q_INIT_ELEM(range, range_link);
+  range->low = stack_low;
+  range->high = stack_high;
+
+  mutex_lock( &g_stack_mutex );
+  set_stk_dir(stack_low, stack_high, NULL);
+  insert_stk_range(range);
+  mutex_unlock( &g_stack_mutex );
+}
+
+/** @brief wakes a thread sleeping in wait_for_wake
+ *  @param meta metadata of the thread to wake
+ *
+ *  the flag is set before make_runnable, so a thread that hasn't
+ *  descheduled yet won't, and make_runnable failing is harmless
+ *
+ *  @return void
+ */
+void wake_thread(thr_stack_meta_t* meta){
+  int tid = meta->tid;
+
+  meta->wake_flag = WAKE_SIGNALED;
+  inline_make_runnable(tid);
+}
+
+/** @brief sleeps until wake_thread is called on the current thread
+ *  @param meta metadata of the current thread, its wake_flag must be
+ *         cleared before the thread becomes visible to wakers
+ *  @return void
+ */
+void wait_for_wake(thr_stack_meta_t* meta){
+  while (!(meta->wake_flag)){
+    inline_deschedule((int *)&(meta->wake_flag));
+  }
+}
+
+/** @brief waits until a terminated thread is no longer running on its stack
+ *  @param stack_meta_ptr metadata of the terminated thread
+ *
+ *  thr_exit marks a thread TERMINATED before it leaves through
+ *  vanish_off_stack, so it may still be using its stack. Yield to it
+ *  until it sets off_stack, a yield failing only means it isn't runnable
+ *  right now (it may be blocked on the way out), so give the CPU to
+ *  anyone then.
+ *
+ *  @return void
+ */
+static void wait_thr_off_cpu(thr_stack_meta_t* stack_meta_ptr){
+  if (stack_meta_ptr->thr_state != TERMINATED){
+    return;
+  }
+
+  while (!(stack_meta_ptr->off_stack)){
+    if (inline_yield(stack_meta_ptr->tid) < 0){
+      inline_yield(YIELD_ANYONE);
+    }
+  }
+}
+
 /** @brief initializes the stack meta and loads it onto the thread table
  *  @param size the size of the stack to allocate
  *  @param func pointer to the function that the child thread should start at
@@ -155,39 +498,88 @@ thr_stack_meta_t* allocate_init_thr_stack(unsigned int size,
   thr_stack_meta_t *free_spot = NULL;
   bool first_init = false;
 
-  // If free_stk_table is not empty
+  // the stack has to hold the part mapped up front, then leave room for
+  // the guard page and round the stack up to its size class
+  if (size < THR_STK_INIT_SIZE){
+    size = THR_STK_INIT_SIZE;
+  }
+  unsigned int usable_size = size;
+  size += THR_STK_GUARD_SIZE;
+  int stk_class = stk_size_class(size);
+  if (stk_class != THR_STK_CLASS_HUGE){
+    size = stk_class_size(stk_class);
+  }
+
+  // If the free_stk_table of the class is not empty
   mutex_lock(&g_free_stk_table_mutex);
-  if (g_free_stk_table.size > 0){
+  if (stk_class != THR_STK_CLASS_HUGE && g_free_stk_tables[stk_class].size > 0){
+    free_stk_table_t *table = &g_free_stk_tables[stk_class];
     first_init = false;
 
-    free_spot = Q_GET_FRONT(&g_free_stk_table);
-    Q_REMOVE(&g_free_stk_table, g_free_stk_table.front, free_stk_table_link);
+    free_spot = Q_GET_FRONT(table);
+    Q_REMOVE(table, free_spot, free_stk_table_link);
     mutex_unlock(&g_free_stk_table_mutex);
   } else {
     first_init = true;
     mutex_unlock(&g_free_stk_table_mutex);
 
-    // Otherwise, lower the g_stacks_brk
+    // the node that will record the range when the stack is released
+    stk_range_t *range = malloc(sizeof(stk_range_t));
+    if (range == NULL){
+      return NULL;
+    }
+
+    // Otherwise, reuse a released range or lower the g_stacks_brk
     mutex_lock( &g_stack_mutex );
-    g_stacks_brk = g_stacks_brk & PAGE_ALIGN_MASK;
-    g_stacks_brk -= size;
-    /* make sure the g_stacks_brk doesn't overwirtten by other threads for later
-       computation */
-    uint32_t local_stack_low = g_stacks_brk;
+    /* make sure the stack range doesn't get overwritten by other threads for
+       later computation */
+    uint32_t local_stack_low = carve_stk_range(size);
+    free_spot = (thr_stack_meta_t*) ((local_stack_low + size) - sizeof(thr_stack_meta_t));
+    int ret = set_stk_dir(local_stack_low, local_stack_low + size, free_spot);
     mutex_unlock( &g_stack_mutex );
-    if (new_pages((void*)local_stack_low, size) < 0){
+
+    // only the top of the stack is mapped, the rest grows on fault
+    if (ret < 0 ||
+        new_pages((void*)(local_stack_low + size - THR_STK_INIT_SIZE),
+                  THR_STK_INIT_SIZE) < 0){
+      // nothing was mapped, give the range straight back
+      Q_INIT_ELEM(range, range_link);
+      range->low = local_stack_low;
+      range->high = local_stack_low + size;
+      mutex_lock( &g_stack_mutex );
+      set_stk_dir(range->low, range->high, NULL);
+      insert_stk_range(range);
+      mutex_unlock( &g_stack_mutex );
       return NULL;
     }
-    free_spot = (thr_stack_meta_t*) ((local_stack_low + size) - sizeof(thr_stack_meta_t));
+    free_spot->range_node = range;
   }
 
-// initialize the free spot stack
-	if ( initialize_stack_meta( free_spot, first_init, func, arg) == ERROR_INIT_STACK_META_FAILED ){
+  // the stack never grows past the size asked for, the rest of its class
+  // stays unmapped below the floor
+  uint32_t floor = (uint32_t)free_spot + sizeof(thr_stack_meta_t) - usable_size;
+  if (!first_init && free_spot->stack_floor != floor){
+    // the chunks are laid out from the floor, so a cached stack starts
+    // over from its first chunk
+    remove_stk_chunks(free_spot->stack_floor, floor + usable_size,
+                      free_spot->stack_mapped_low);
+    free_spot->stack_mapped_low = floor + usable_size - THR_STK_INIT_SIZE;
+  }
+  free_spot->stack_floor = floor;
 
-    // move the newly allocated but can't initialzied stack, to free_stk_table
-    mutex_lock( &g_free_stk_table_mutex );
-    Q_INSERT_TAIL( &g_free_stk_table, free_spot, free_stk_table_link );
-    mutex_unlock( &g_free_stk_table_mutex );
+// initialize the free spot stack
+	if ( initialize_stack_meta( free_spot, first_init, size, func, arg) == ERROR_INIT_STACK_META_FAILED ){
+
+    // move the stack back to free_stk_table, or give a fresh one back
+    free_spot->stk_class = stk_class;
+    free_spot->stack_high = (uint32_t)free_spot + sizeof(thr_stack_meta_t);
+    free_spot->stack_low = free_spot->stack_high - size;
+    if ( first_init ){
+      free_spot->stack_mapped_low = free_spot->stack_high - THR_STK_INIT_SIZE;
+    }
+    if ( first_init || !cache_thr_stack(free_spot, true) ){
+      release_thr_stack(free_spot);
+    }
 		printf("allocate_init_thr_stack: can't initialize stack meta.\n");
     return NULL;
 	}
@@ -200,8 +592,13 @@ thr_stack_meta_t* allocate_init_thr_stack(unsigned int size,
   return free_spot;
 }
 
-/** @brief removes a metadata entry from the global table and adds to free_stk_table
+/** @brief removes a metadata entry from the global table and recycles its stack
  *  @param stack_meta_ptr the pointer of thr_stack to remove from the global thread table
+ *
+ *  the stack goes to the free_stk_table of its size class while that
+ *  holds fewer than THR_STK_CACHE_HIGH_WATER stacks, otherwise its pages
+ *  are removed.
+ *
  *  @returns void
  */
 void free_thr_stack(thr_stack_meta_t* stack_meta_ptr){
@@ -222,11 +619,49 @@ void free_thr_stack(thr_stack_meta_t* stack_meta_ptr){
     Q_REMOVE( &g_thr_table, stack_meta_ptr, thr_table_link );
     mutex_unlock( &g_thr_table_mutex );
 
-    // then append stack to free_stk_table
-    mutex_lock( &g_free_stk_table_mutex );
-    Q_INSERT_TAIL( &g_free_stk_table, stack_meta_ptr, free_stk_table_link );
-    mutex_unlock( &g_free_stk_table_mutex );
+    // nor while its creator still writes the tid into it, a joiner may have
+    // learned the tid from the child itself
+    while ( stack_meta_ptr->creating ){
+      inline_yield( YIELD_ANYONE );
+    }
+
+    // the stack can't be reused or unmapped while its owner still runs on it
+    wait_thr_off_cpu( stack_meta_ptr );
+
+    // then append stack to free_stk_table, up to the high-water mark
+    if ( !cache_thr_stack( stack_meta_ptr, false ) ){
+      release_thr_stack( stack_meta_ptr );
+    }
+}
+
+/** @brief recycles the stacks of detached threads that have exited
+ *
+ *  a detached thread can't free its own stack while it runs on it, so
+ *  thr_exit leaves it on g_zombie_list. Every thread on the list is
+ *  taken off and freed like a joined thread: a zombie only has to drop
+ *  its metadata mutex and reach vanish_off_stack, so free_thr_stack
+ *  waiting for it (and for its creator to finish writing its metadata)
+ *  never blocks for long, and no zombie is left for a later call.
+ *
+ *  @return void
+ */
+void reap_detached_threads(void){
+  zombie_list_t reaped;
+  Q_INIT_HEAD(&reaped);
+
+  mutex_lock( &g_zombie_mutex );
+  thr_stack_meta_t *meta;
+  while ((meta = Q_GET_FRONT(&g_zombie_list)) != NULL){
+    Q_REMOVE(&g_zombie_list, meta, free_stk_table_link);
+    Q_INSERT_TAIL(&reaped, meta, free_stk_table_link);
+  }
+  mutex_unlock( &g_zombie_mutex );
 
+  // free_thr_stack reuses the link, so take each thread off first
+  while ((meta = Q_GET_FRONT(&reaped)) != NULL){
+    Q_REMOVE(&reaped, meta, free_stk_table_link);
+    free_thr_stack(meta);
+  }
 }
 
 /** @brief wrapper for the initial thread function
@@ -235,20 +670,17 @@ void free_thr_stack(thr_stack_meta_t* stack_meta_ptr){
  *  @return never returns
  */
 void run_thr_func(void *(*func)(void *), void *arg){
-  // install exception handler
-  install_swexn();
-
   thr_stack_meta_t *stack_meta_ptr = find_current_thread_meta();
 
   affirm_msg( stack_meta_ptr != NULL, "thr_create: new thread could not be created!");
 
-  // wait until the parent thread make the child thread runnable.
-  mutex_lock( &(stack_meta_ptr->meta_mutex) );
+  // install exception handler on the thread's own exception stack
+  install_swexn(stack_meta_ptr);
 
-  while (stack_meta_ptr->thr_state != RUNNABLE) {
-      cond_wait( &(stack_meta_ptr->meta_cv), &(stack_meta_ptr->meta_mutex) );
-  }
-  mutex_unlock( &(stack_meta_ptr->meta_mutex) );
+  // publish our own tid instead of waiting for the parent to do it, the
+  // parent stores the same value when thread_fork returns to it
+  stack_meta_ptr->tid = inline_gettid();
+  stack_meta_ptr->thr_state = RUNNABLE;
 
   // the function should call thr_exit and not return
   void *ret = func(arg);
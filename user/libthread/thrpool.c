@@ -0,0 +1,569 @@
+/** @file thrpool.c
+ *  @brief implementation of a work-stealing thread pool
+ *
+ *  Every worker owns a Chase-Lev deque. A worker pushes and takes tasks at
+ *  the bottom of its own deque without locking, and steals from the top
+ *  of the other workers' deques when its own runs dry. Tasks submitted
+ *  from threads outside the pool, or that overflow a deque, go to a shared
+ *  queue protected by the pool mutex. Workers with nothing to do park
+ *  themselves with deschedule until a submit wakes them.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <syscall.h>
+#include <syscall_inline.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond.h>
+#include <thrpool.h>
+#include "thr_internals.h"
+#include "mutex_private.h"
+#include "error_code.h"
+
+/** mask turning a deque index into a slot of the task buffer */
+#define THRPOOL_DEQUE_MASK (THRPOOL_DEQUE_SIZE - 1)
+
+/** @brief pushes a task at the bottom of a deque, called by the owner only
+ *  @param deque the deque of the calling worker
+ *  @param task the task to push
+ *  @return 0 on success, negative number if the deque is full
+ */
+static int deque_push(thrpool_deque_t *deque, thrpool_task_t *task)
+{
+  int bottom = deque->bottom;
+  int top = deque->top;
+
+  if ( bottom - top >= THRPOOL_DEQUE_SIZE )
+  {
+    return -1;
+  }
+
+  // the slot must be written before thieves can see the new bottom
+  deque->tasks[bottom & THRPOOL_DEQUE_MASK] = task;
+  deque->bottom = bottom + 1;
+  return SUCCESS_RETURN;
+}
+
+/** @brief takes the newest task off the bottom of a deque, called by the
+ *         owner only
+ *  @param deque the deque of the calling worker
+ *  @return the task, NULL if the deque is empty or a thief won the last task
+ */
+static thrpool_task_t *deque_take(thrpool_deque_t *deque)
+{
+  int bottom = deque->bottom - 1;
+
+  // the read of top must not pass the store of bottom
+  deque->bottom = bottom;
+  memory_barrier();
+  int top = deque->top;
+
+  if ( top > bottom )
+  {
+    deque->bottom = bottom + 1;
+    return NULL;
+  }
+
+  thrpool_task_t *task = deque->tasks[bottom & THRPOOL_DEQUE_MASK];
+  if ( top == bottom )
+  {
+    // last task, race the thieves for it
+    if ( atomic_compare_swap( (volatile unsigned int *)&(deque->top), top, top + 1 )
+         != (unsigned int)top )
+    {
+      task = NULL;
+    }
+    deque->bottom = bottom + 1;
+  }
+  return task;
+}
+
+/** @brief steals the oldest task off the top of another worker's deque
+ *  @param deque the deque to steal from
+ *  @return the task, NULL if the deque is empty or the steal lost a race
+ */
+static thrpool_task_t *deque_steal(thrpool_deque_t *deque)
+{
+  int top = deque->top;
+  int bottom = deque->bottom;
+
+  if ( top >= bottom )
+  {
+    return NULL;
+  }
+
+  thrpool_task_t *task = deque->tasks[top & THRPOOL_DEQUE_MASK];
+  if ( atomic_compare_swap( (volatile unsigned int *)&(deque->top), top, top + 1 )
+       != (unsigned int)top )
+  {
+    return NULL;
+  }
+  return task;
+}
+
+/** @brief finds the worker of the pool that is the calling thread
+ *  @param pool the pool to search
+ *  @return the worker, NULL if the caller isn't one of the pool's workers
+ */
+static thrpool_worker_t *current_worker(thrpool_t *pool)
+{
+  int tid = thr_getid();
+  int i;
+
+  for ( i = 0; i < pool->num_workers; i++ )
+  {
+    if ( pool->workers[i].tid == tid )
+    {
+      return &(pool->workers[i]);
+    }
+  }
+  return NULL;
+}
+
+/** @brief checks whether any task is waiting to be run
+ *  @param pool the pool to check
+ *  @return true if the shared queue or any deque holds a task
+ */
+static bool has_work(thrpool_t *pool)
+{
+  if ( (pool->shared_queue.size) > 0 )
+  {
+    return true;
+  }
+
+  int i;
+  for ( i = 0; i < pool->num_workers; i++ )
+  {
+    thrpool_deque_t *deque = &(pool->workers[i].deque);
+    if ( deque->bottom - deque->top > 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** @brief finds a task for a worker to run
+ *  @param self the calling worker
+ *
+ *  looks at the worker's own deque first, then the shared queue, then
+ *  tries to steal from each of the other workers in turn
+ *
+ *  @return the task, NULL if no task was found
+ */
+static thrpool_task_t *find_task(thrpool_worker_t *self)
+{
+  thrpool_t *pool = self->pool;
+  thrpool_task_t *task = deque_take( &(self->deque) );
+
+  if ( task != NULL )
+  {
+    return task;
+  }
+
+  if ( (pool->shared_queue.size) > 0 )
+  {
+    mutex_lock( &(pool->pool_mutex) );
+    task = Q_GET_FRONT( &(pool->shared_queue) );
+    if ( task != NULL )
+    {
+      Q_REMOVE( &(pool->shared_queue), task, task_link );
+    }
+    mutex_unlock( &(pool->pool_mutex) );
+
+    if ( task != NULL )
+    {
+      return task;
+    }
+  }
+
+  int i;
+  for ( i = 1; i < pool->num_workers; i++ )
+  {
+    int victim = (self->index + i) % (pool->num_workers);
+    task = deque_steal( &(pool->workers[victim].deque) );
+    if ( task != NULL )
+    {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/** @brief marks one task of a group as finished
+ *  @param pool the pool the task ran on
+ *  @param group the group of the task, may be NULL
+ *  @return void
+ */
+static void finish_pending(thrpool_t *pool, thrpool_group_t *group)
+{
+  if ( group == NULL )
+  {
+    return;
+  }
+
+  if ( atomic_decrement( &(group->pending) ) == 1 )
+  {
+    mutex_lock( &(pool->pool_mutex) );
+    cond_broadcast( &(pool->idle_cv) );
+    mutex_unlock( &(pool->pool_mutex) );
+  }
+}
+
+/** @brief runs a task and releases it
+ *  @param pool the pool the task was submitted to
+ *  @param task the task to run
+ *  @return void
+ */
+static void run_task(thrpool_t *pool, thrpool_task_t *task)
+{
+  thrpool_group_t *group = (task->group);
+
+  (task->func)( task->arg );
+  free( task );
+
+  finish_pending( pool, group );
+  finish_pending( pool, &(pool->all) );
+}
+
+/** @brief wakes one parked worker, if there is any
+ *  @param pool the pool to wake a worker in
+ *  @return void
+ */
+static void wake_worker(thrpool_t *pool)
+{
+  // the task just queued must be visible before we look
+  memory_barrier();
+  if ( atomic_load( &(pool->num_parked) ) == 0 )
+  {
+    return;
+  }
+
+  thrpool_worker_t *parked = NULL;
+  mutex_lock( &(pool->pool_mutex) );
+  int i;
+  for ( i = 0; i < pool->num_workers; i++ )
+  {
+    if ( pool->workers[i].parked )
+    {
+      parked = &(pool->workers[i]);
+      (parked->parked) = false;
+      (pool->num_parked) -= 1;
+      (parked->wake) = 1;
+      break;
+    }
+  }
+  mutex_unlock( &(pool->pool_mutex) );
+
+  // the wake flag covers the case where the worker hasn't descheduled yet
+  if ( parked != NULL )
+  {
+    inline_make_runnable( parked->tid );
+  }
+}
+
+/** @brief wakes every parked worker
+ *  @param pool the pool to wake the workers of
+ *  @return void
+ */
+static void wake_all_workers(thrpool_t *pool)
+{
+  int i;
+  for ( i = 0; i < pool->num_workers; i++ )
+  {
+    thrpool_worker_t *worker = &(pool->workers[i]);
+    bool was_parked = false;
+
+    mutex_lock( &(pool->pool_mutex) );
+    if ( worker->parked )
+    {
+      was_parked = true;
+      (worker->parked) = false;
+      (pool->num_parked) -= 1;
+      (worker->wake) = 1;
+    }
+    mutex_unlock( &(pool->pool_mutex) );
+
+    if ( was_parked )
+    {
+      inline_make_runnable( worker->tid );
+    }
+  }
+}
+
+/** @brief parks a worker until there is work again
+ *  @param self the calling worker
+ *  @return void
+ */
+static void park_worker(thrpool_worker_t *self)
+{
+  thrpool_t *pool = (self->pool);
+
+  mutex_lock( &(pool->pool_mutex) );
+  (self->wake) = 0;
+  (self->parked) = true;
+  atomic_increment( &(pool->num_parked) );
+
+  // a submit that missed us in num_parked left its task where we can see it
+  if ( pool->shutdown || has_work( pool ) )
+  {
+    (self->parked) = false;
+    (pool->num_parked) -= 1;
+    mutex_unlock( &(pool->pool_mutex) );
+    return;
+  }
+  mutex_unlock( &(pool->pool_mutex) );
+
+  while ( !(self->wake) )
+  {
+    inline_deschedule( (int *)&(self->wake) );
+  }
+}
+
+/** @brief main loop of a worker thread
+ *  @param arg the worker the thread runs as
+ *  @return NULL once the pool shuts down
+ */
+static void *worker_main(void *arg)
+{
+  thrpool_worker_t *self = (thrpool_worker_t *) arg;
+  thrpool_t *pool = (self->pool);
+
+  // publish our tid ourselves, a submit may need it before thr_create returns
+  (self->tid) = thr_getid();
+
+  while ( !(pool->shutdown) )
+  {
+    thrpool_task_t *task = find_task( self );
+    if ( task != NULL )
+    {
+      run_task( pool, task );
+    }
+    else
+    {
+      park_worker( self );
+    }
+  }
+  return NULL;
+}
+
+/** @brief stops and joins the first num_started workers of a pool
+ *  @param pool the pool to stop
+ *  @param num_started the number of workers that were created
+ *  @return void
+ */
+static void stop_workers(thrpool_t *pool, int num_started)
+{
+  (pool->shutdown) = 1;
+  wake_all_workers( pool );
+
+  int i;
+  for ( i = 0; i < num_started; i++ )
+  {
+    thr_join( pool->workers[i].tid, NULL );
+  }
+}
+
+/** @brief initializes a thread pool and starts its workers
+ *  @param pool pointer to the pool to initialize
+ *  @param num_workers the number of worker threads to run
+ *
+ *  requires thr_init has been called
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int thrpool_init( thrpool_t *pool, int num_workers )
+{
+  if ( pool == NULL )
+  {
+    printf("thrpool_init: pool pointer is NULL.\n");
+    return ERROR_NULL_POINTER;
+  }
+
+  if ( pool->valid )
+  {
+    printf("thrpool_init: trying to init an initialized pool!\n");
+    return ERROR_DOUBLE_INITIALIZATION;
+  }
+
+  if ( num_workers <= 0 )
+  {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  int ret = 0;
+  ret |= mutex_init( &(pool->pool_mutex) );
+  ret |= cond_init( &(pool->idle_cv) );
+  if ( ret < 0 )
+  {
+    return ERROR_INIT_ON_USE;
+  }
+
+  (pool->workers) = calloc( num_workers, sizeof(thrpool_worker_t) );
+  if ( pool->workers == NULL )
+  {
+    cond_destroy( &(pool->idle_cv) );
+    mutex_destroy( &(pool->pool_mutex) );
+    return ERROR_MALLOC_FAILED;
+  }
+
+  Q_INIT_HEAD( &(pool->shared_queue) );
+  (pool->num_workers) = num_workers;
+  (pool->num_parked) = 0;
+  (pool->shutdown) = 0;
+  thrpool_group_init( &(pool->all) );
+
+  int i;
+  for ( i = 0; i < num_workers; i++ )
+  {
+    pool->workers[i].pool = pool;
+    pool->workers[i].tid = UNSIGNED_TID;
+    pool->workers[i].index = i;
+  }
+
+  for ( i = 0; i < num_workers; i++ )
+  {
+    int tid = thr_create( worker_main, &(pool->workers[i]) );
+    if ( tid < 0 )
+    {
+      stop_workers( pool, i );
+      free( pool->workers );
+      cond_destroy( &(pool->idle_cv) );
+      mutex_destroy( &(pool->pool_mutex) );
+      return ERROR_THR_CREATE_FAILED;
+    }
+    pool->workers[i].tid = tid;
+  }
+
+  (pool->valid) = true;
+  return SUCCESS_RETURN;
+}
+
+/** @brief waits for every task of a pool, then stops its workers
+ *  @param pool pointer to the pool to destroy
+ *
+ *  requires pool is initialized and the caller is not one of its workers
+ *
+ *  @return void
+ */
+void thrpool_destroy( thrpool_t *pool )
+{
+  if ( pool == NULL || !(pool->valid) )
+  {
+    printf("thrpool_destroy: trying to destroy an uninitialized pool!\n");
+    return;
+  }
+
+  thrpool_wait( pool, NULL );
+  stop_workers( pool, pool->num_workers );
+
+  (pool->valid) = false;
+  free( pool->workers );
+  (pool->workers) = NULL;
+  (pool->num_workers) = 0;
+  cond_destroy( &(pool->idle_cv) );
+  mutex_destroy( &(pool->pool_mutex) );
+}
+
+/** @brief initializes an empty task group
+ *  @param group pointer to the group to initialize
+ *  @return void
+ */
+void thrpool_group_init( thrpool_group_t *group )
+{
+  (group->pending) = 0;
+}
+
+/** @brief submits a task to a pool
+ *  @param pool the pool to run the task on
+ *  @param group the group to count the task against, may be NULL
+ *  @param func function that runs the task
+ *  @param arg argument to pass to func
+ *
+ *  a worker submitting a task pushes it onto its own deque, any other
+ *  thread puts it on the shared queue
+ *
+ *  @return 0 on success, negative number on failure
+ */
+int thrpool_submit( thrpool_t *pool, thrpool_group_t *group,
+                    void (*func)(void *), void *arg )
+{
+  if ( pool == NULL || func == NULL )
+  {
+    return ERROR_NULL_POINTER;
+  }
+
+  thrpool_task_t *task = malloc( sizeof(thrpool_task_t) );
+  if ( task == NULL )
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+
+  Q_INIT_ELEM( task, task_link );
+  (task->func) = func;
+  (task->arg) = arg;
+  (task->group) = group;
+
+  if ( group != NULL )
+  {
+    atomic_increment( &(group->pending) );
+  }
+  atomic_increment( &(pool->all.pending) );
+
+  thrpool_worker_t *self = current_worker( pool );
+  if ( self == NULL || deque_push( &(self->deque), task ) < 0 )
+  {
+    mutex_lock( &(pool->pool_mutex) );
+    Q_INSERT_TAIL( &(pool->shared_queue), task, task_link );
+    mutex_unlock( &(pool->pool_mutex) );
+  }
+
+  wake_worker( pool );
+  return SUCCESS_RETURN;
+}
+
+/** @brief waits until every task of a group has finished
+ *  @param pool the pool the tasks were submitted to
+ *  @param group the group to wait on, NULL waits on every task of the pool
+ *
+ *  a worker waiting on a group keeps running tasks meanwhile, so divide
+ *  and conquer tasks can wait on their subtasks without tying up workers
+ *
+ *  @return void
+ */
+void thrpool_wait( thrpool_t *pool, thrpool_group_t *group )
+{
+  if ( group == NULL )
+  {
+    group = &(pool->all);
+  }
+
+  thrpool_worker_t *self = current_worker( pool );
+  if ( self != NULL )
+  {
+    while ( (group->pending) > 0 )
+    {
+      thrpool_task_t *task = find_task( self );
+      if ( task != NULL )
+      {
+        run_task( pool, task );
+      }
+      else
+      {
+        thr_yield( YIELD_ANYONE );
+      }
+    }
+    return;
+  }
+
+  mutex_lock( &(pool->pool_mutex) );
+  while ( (group->pending) > 0 )
+  {
+    cond_wait( &(pool->idle_cv), &(pool->pool_mutex) );
+  }
+  mutex_unlock( &(pool->pool_mutex) );
+}
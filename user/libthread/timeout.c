@@ -0,0 +1,174 @@
+/** @file timeout.c
+ *  @brief implementation of deadlines for blocking waits
+ *
+ *  The kernel only offers deschedule, which sleeps until make_runnable,
+ *  and sleep, which can't be cut short. A thread that must give up at a
+ *  get_ticks() deadline therefore puts itself on g_timeout_list, sorted
+ *  by deadline, and deschedules as usual. A timeout thread serves the
+ *  list while it is nonempty: once a tick it wakes every thread whose
+ *  deadline has passed, with wake_flag set to WAKE_TIMED_OUT so the thread
+ *  can tell it apart from a real wake. The timeout thread exits when the
+ *  list drains, so it never keeps the task alive, and the next timed wait
+ *  joins it before starting a new one.
+ *
+ *  @author Tianya Chen (andrewid: tianyac, email: tianyac@andrew.cmu.edu)
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <syscall.h>
+#include <syscall_inline.h>
+#include <thread.h>
+#include <mutex.h>
+#include <mutex_private.h>
+#include "thr_internals.h"
+#include "error_code.h"
+
+/** @brief checks whether a get_ticks() deadline has passed
+ *  @param deadline the deadline
+ *
+ *  compares through a signed difference, so it stays right when the
+ *  tick counter wraps around
+ *
+ *  @return true if the deadline is now or in the past
+ */
+bool deadline_passed(unsigned int deadline){
+  return (int)(deadline - inline_get_ticks()) <= 0;
+}
+
+/** @brief wakes every thread on the timed wait list whose deadline passed
+ *
+ *  requires g_timeout_mutex is held
+ *
+ *  @return void
+ */
+static void expire_timeouts(void){
+  thr_stack_meta_t* meta = Q_GET_FRONT(&g_timeout_list);
+
+  while (meta != NULL && deadline_passed(meta->wake_deadline)){
+    thr_stack_meta_t* next = Q_GET_NEXT(meta, timeout_link);
+    Q_REMOVE(&g_timeout_list, meta, timeout_link);
+    Q_INIT_ELEM(meta, timeout_link);
+
+    // a real wake may have beaten us to it, leave its flag alone
+    if (atomic_compare_swap((volatile unsigned int *)&(meta->wake_flag), 0,
+                            WAKE_TIMED_OUT) == 0){
+      inline_make_runnable(meta->tid);
+    }
+    meta = next;
+  }
+}
+
+/** @brief body of the timeout thread
+ *  @param arg unused
+ *  @return NULL
+ */
+static void *timeout_thread(void *arg){
+  mutex_lock(&g_timeout_mutex);
+  while (g_timeout_list.size > 0){
+    expire_timeouts();
+    mutex_unlock(&g_timeout_mutex);
+
+    inline_sleep(1);
+
+    mutex_lock(&g_timeout_mutex);
+  }
+  g_timeout_running = false;
+  mutex_unlock(&g_timeout_mutex);
+
+  return NULL;
+}
+
+/** @brief starts the timeout thread, reaping the one that ran before
+ *  @return 0 on success, negative number on failure
+ */
+static int start_timeout_thread(void){
+  mutex_lock(&g_timeout_start_mutex);
+
+  if (g_timeout_tid != UNSIGNED_TID){
+    thr_join(g_timeout_tid, NULL);
+  }
+
+  int tid = thr_create(timeout_thread, NULL);
+  g_timeout_tid = (tid < 0) ? UNSIGNED_TID : tid;
+
+  mutex_unlock(&g_timeout_start_mutex);
+  return tid;
+}
+
+/** @brief puts the current thread on the timed wait list
+ *  @param meta metadata of the current thread
+ *  @param deadline the get_ticks() deadline
+ *  @return 0 on success, negative number if no timeout thread could be
+ *          started to serve the list
+ */
+static int arm_timeout(thr_stack_meta_t* meta, unsigned int deadline){
+  meta->wake_deadline = deadline;
+
+  mutex_lock(&g_timeout_mutex);
+  thr_stack_meta_t* next = Q_GET_FRONT(&g_timeout_list);
+  while (next != NULL && (int)(next->wake_deadline - deadline) <= 0){
+    next = Q_GET_NEXT(next, timeout_link);
+  }
+  if (next == NULL){
+    Q_INSERT_TAIL(&g_timeout_list, meta, timeout_link);
+  }
+  else {
+    Q_INSERT_BEFORE(&g_timeout_list, next, meta, timeout_link);
+  }
+
+  bool start = !g_timeout_running;
+  g_timeout_running = true;
+  mutex_unlock(&g_timeout_mutex);
+
+  if (start && start_timeout_thread() < 0){
+    mutex_lock(&g_timeout_mutex);
+    Q_REMOVE(&g_timeout_list, meta, timeout_link);
+    Q_INIT_ELEM(meta, timeout_link);
+    g_timeout_running = false;
+    mutex_unlock(&g_timeout_mutex);
+    return ERROR_TIMED_OUT;
+  }
+  return SUCCESS_RETURN;
+}
+
+/** @brief takes the current thread off the timed wait list, if the timeout
+ *         thread hasn't already
+ *  @param meta metadata of the current thread
+ *
+ *  the timeout thread only touches threads on the list, so once this
+ *  returns it will not set the wake flag of a later wait
+ *
+ *  @return void
+ */
+static void disarm_timeout(thr_stack_meta_t* meta){
+  mutex_lock(&g_timeout_mutex);
+  // expire_timeouts clears the link of any thread it takes off
+  if (Q_GET_PREV(meta, timeout_link) != NULL ||
+      Q_GET_FRONT(&g_timeout_list) == meta){
+    Q_REMOVE(&g_timeout_list, meta, timeout_link);
+    Q_INIT_ELEM(meta, timeout_link);
+  }
+  mutex_unlock(&g_timeout_mutex);
+}
+
+/** @brief sleeps until wake_thread is called on the current thread, or
+ *         until a deadline passes
+ *  @param meta metadata of the current thread, its wake_flag must be
+ *         cleared before the thread becomes visible to wakers
+ *  @param deadline the get_ticks() deadline
+ *
+ *  The thread may still be on the queue it waited on when this returns,
+ *  and a waker may still be about to wake it: the caller has to settle
+ *  that under the lock of the queue.
+ *
+ *  @return 0 if woken, ERROR_TIMED_OUT if the deadline passed first
+ */
+int wait_for_wake_until(thr_stack_meta_t* meta, unsigned int deadline){
+  if (!deadline_passed(deadline) && arm_timeout(meta, deadline) == 0){
+    wait_for_wake(meta);
+    disarm_timeout(meta);
+  }
+
+  return (meta->wake_flag == WAKE_SIGNALED) ? SUCCESS_RETURN : ERROR_TIMED_OUT;
+}
@@ -0,0 +1,93 @@
+/** @file barrier_bench.c
+ *  @brief times barrier_wait with 2 to 64 threads
+ *
+ *  For every thread count, that many threads go through NUM_ROUNDS
+ *  rounds of the same barrier, and the ticks the rounds took are
+ *  printed. The clock starts once every worker has passed a warm-up
+ *  round, and stops when the last round opens, so creating and joining
+ *  the threads isn't timed.
+ */
+
+#include <stdio.h>
+#include <syscall.h>
+#include <thread.h>
+#include <barrier.h>
+
+#define MAX_THREADS 64
+#define NUM_ROUNDS 200
+#define STACK_SIZE 4096
+
+barrier_t g_barrier;
+unsigned int g_start;   ///< ticks when the warm-up round opened
+unsigned int g_ticks;   ///< ticks from the warm-up round to the last one
+
+/** @brief goes through the warm-up round and every timed round
+ *  @param arg nonzero for the one worker that reads the clock
+ *  @return NULL
+ */
+void *worker(void *arg)
+{
+  int round;
+
+  barrier_wait( &g_barrier );
+  if ( arg != NULL )
+  {
+    g_start = get_ticks();
+  }
+
+  for ( round = 0; round < NUM_ROUNDS; round++ )
+  {
+    barrier_wait( &g_barrier );
+  }
+
+  if ( arg != NULL )
+  {
+    g_ticks = get_ticks() - g_start;
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int tids[MAX_THREADS];
+  int num_threads;
+  int i;
+
+  if ( thr_init( STACK_SIZE ) < 0 )
+  {
+    printf( "barrier_bench: thr_init failed\n" );
+    return -1;
+  }
+
+  for ( num_threads = 2; num_threads <= MAX_THREADS; num_threads *= 2 )
+  {
+    if ( barrier_init( &g_barrier, num_threads ) < 0 )
+    {
+      printf( "barrier_bench: barrier_init failed\n" );
+      return -1;
+    }
+
+    for ( i = 0; i < num_threads; i++ )
+    {
+      tids[i] = thr_create( worker, (i == 0) ? (void *)1 : NULL );
+      if ( tids[i] < 0 )
+      {
+        printf( "barrier_bench: thr_create failed\n" );
+        return -1;
+      }
+    }
+
+    for ( i = 0; i < num_threads; i++ )
+    {
+      thr_join( tids[i], NULL );
+    }
+
+    printf( "barrier_bench: %d threads, %d rounds, %u ticks\n",
+            num_threads, NUM_ROUNDS, g_ticks );
+
+    barrier_destroy( &g_barrier );
+  }
+
+  thr_exit( NULL );
+  return 0;
+}
@@ -0,0 +1,108 @@
+/** @file cond_broadcast_bench.c
+ *  @brief times cond_broadcast waking many threads waiting on one cv
+ *
+ *  NUM_WAITERS threads wait on a single condition variable for the next
+ *  generation. Each round the root thread bumps the generation, broadcasts,
+ *  and waits until every waiter has seen it, so a round measures how fast
+ *  all the woken threads get through the mutex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <thread.h>
+#include <mutex.h>
+#include <cond.h>
+
+#define NUM_WAITERS 64
+#define NUM_ROUNDS 100
+#define STACK_SIZE 4096
+
+mutex_t g_mutex;
+cond_t g_gen_cv;      ///< waiters wait here for the next generation
+cond_t g_done_cv;     ///< the root waits here for the waiters to catch up
+int g_generation = 0;
+int g_seen = 0;       ///< waiters that have seen the current generation
+
+/** @brief waits for every generation and reports back
+ *  @param arg unused
+ *  @return NULL
+ */
+void *waiter(void *arg)
+{
+  int gen = 0;
+
+  mutex_lock( &g_mutex );
+  while ( gen < NUM_ROUNDS )
+  {
+    while ( g_generation == gen )
+    {
+      cond_wait( &g_gen_cv, &g_mutex );
+    }
+    gen = g_generation;
+
+    if ( ++g_seen == NUM_WAITERS )
+    {
+      cond_signal( &g_done_cv );
+    }
+  }
+  mutex_unlock( &g_mutex );
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int tids[NUM_WAITERS];
+  int i;
+
+  if ( thr_init( STACK_SIZE ) < 0 )
+  {
+    printf( "cond_broadcast_bench: thr_init failed\n" );
+    return -1;
+  }
+
+  mutex_init( &g_mutex );
+  cond_init( &g_gen_cv );
+  cond_init( &g_done_cv );
+
+  for ( i = 0; i < NUM_WAITERS; i++ )
+  {
+    tids[i] = thr_create( waiter, NULL );
+    if ( tids[i] < 0 )
+    {
+      printf( "cond_broadcast_bench: thr_create failed\n" );
+      return -1;
+    }
+  }
+
+  unsigned int start = get_ticks();
+
+  int round;
+  for ( round = 1; round <= NUM_ROUNDS; round++ )
+  {
+    mutex_lock( &g_mutex );
+    g_seen = 0;
+    g_generation = round;
+    cond_broadcast( &g_gen_cv );
+
+    while ( g_seen < NUM_WAITERS )
+    {
+      cond_wait( &g_done_cv, &g_mutex );
+    }
+    mutex_unlock( &g_mutex );
+  }
+
+  unsigned int ticks = get_ticks() - start;
+
+  for ( i = 0; i < NUM_WAITERS; i++ )
+  {
+    thr_join( tids[i], NULL );
+  }
+
+  printf( "cond_broadcast_bench: %d waiters, %d rounds, %u ticks\n",
+          NUM_WAITERS, NUM_ROUNDS, ticks );
+
+  thr_exit( NULL );
+  return 0;
+}